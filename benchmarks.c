@@ -0,0 +1,1422 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "unit_testing.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "symposium.h"
+
+
+/*
+ *
+ *   BENCHMARKS
+ *
+ *   Each benchmark is a bare test, which boots tinyos as needed and
+ *   reports its measurements via MSG(). The benchmarks can be listed
+ *   and selected exactly as the tests of validate_api, e.g.
+ *
+ *      ./benchmarks -l
+ *      ./benchmarks bench_sched_select
+ *
+ *   For meaningful numbers, build with DEBUG=0.
+ */
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Benchmark utilities
+ *
+ *
+ *
+ *********************************************/
+
+
+/* Monotonic wall clock, in nanoseconds */
+static double clock_ns()
+{
+	struct timespec t;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &t));
+	return 1E9 * t.tv_sec + t.tv_nsec;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/* The voluntary context switches of the host threads so far */
+static long host_switches()
+{
+	struct rusage ru;
+	CHECK(getrusage(RUSAGE_SELF, &ru));
+	return ru.ru_nvcsw;
+}
+
+/* The CPU time of the program on the host so far, in seconds */
+static double host_cpu_time()
+{
+	struct rusage ru;
+	CHECK(getrusage(RUSAGE_SELF, &ru));
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec 
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1E6;
+}
+
+/* 
+  The CPU time of the current thread, as charged by the scheduler. On a
+  host with fewer processors than cores, this is the time the thread ran
+  on its core. 
+ */
+static TimerDuration thread_cpu_time()
+{
+	int preempt = preempt_off;
+	TCB* self = cur_thread();
+	TimerDuration t = self->cpu_time + (bios_clock() - self->slice_start);
+	if(preempt) preempt_on;
+	return t;
+}
+
+/*
+  Run nthreads threads of task, the i-th with argument (i, args), until
+  they all exit, and return the elapsed time in nanoseconds.
+ */
+static double run_threads(int nthreads, Task task, void* args)
+{
+	Tid_t tid[nthreads];
+
+	double t0 = clock_ns();
+	for(int i=0; i<nthreads; i++)
+		tid[i] = CreateThread(task, i, args);
+	for(int i=0; i<nthreads; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	return clock_ns() - t0;
+}
+
+/* Boot the kernel with the given options, and return the scheduler statistics of the run */
+static sched_stats boot_stats(uint ncores, Task boot_task, int argl, void* args, 
+	const boot_options* opts)
+{
+	sched_stats stats;
+	boot_with_options(ncores, 0, boot_task, argl, args, opts);
+	get_sched_stats(&stats);
+	return stats;
+}
+
+
+/*
+  Two threads, 0 and 1, that take turns under a mutex. While holding mx,
+  a thread waits for its turn with pingpong_wait(), and passes the turn
+  to the other thread with pingpong_pass(). The turn starts at 0.
+ */
+typedef struct pingpong {
+	Mutex mx;
+	CondVar cv;
+	int turn;
+} __attribute__((aligned(64))) pingpong;
+
+static void pingpong_init(pingpong* pp)
+{
+	pp->mx = MUTEX_INIT;
+	pp->cv = COND_INIT;
+	pp->turn = 0;
+}
+
+/* Wait for the turn of thread me, for msec at a time, or without a timeout if msec is 0 */
+static void pingpong_wait(pingpong* pp, int me, timeout_t msec)
+{
+	while(pp->turn != me) {
+		if(msec)
+			Cond_TimedWait(&pp->mx, &pp->cv, msec);
+		else
+			Cond_Wait(&pp->mx, &pp->cv);
+	}
+}
+
+static void pingpong_pass(pingpong* pp, int me)
+{
+	pp->turn = 1-me;
+	Cond_Signal(&pp->cv);
+}
+
+
+/*
+  Threads that block on condition variables of their own, each for msec
+  at a time, or without a timeout if msec is 0, until they are released.
+  The caller sets msec, and idle_start() the rest.
+ */
+typedef struct idle_waiter {
+	Mutex mx;
+	CondVar cv;
+	int state;		/* 0: starting, 1: waiting, 2: released */
+	timeout_t msec;
+	Tid_t tid;
+} idle_waiter;
+
+static int idle_waiter_task(int argl, void* args)
+{
+	idle_waiter* w = args;
+	Mutex_Lock(&w->mx);
+	w->state = 1;
+	Cond_Signal(&w->cv);
+	while(w->state == 1) {
+		if(w->msec)
+			Cond_TimedWait(&w->mx, &w->cv, w->msec);
+		else
+			Cond_Wait(&w->mx, &w->cv);
+	}
+	Mutex_Unlock(&w->mx);
+	return 0;
+}
+
+/* Start n waiters, with the given thread attributes, and return when all of them wait */
+static void idle_start(idle_waiter* w, int n, const thread_attr* attr)
+{
+	for(int i=0; i<n; i++) {
+		w[i].mx = MUTEX_INIT;
+		w[i].cv = COND_INIT;
+		w[i].state = 0;
+		w[i].tid = CreateThreadAttr(idle_waiter_task, 0, &w[i], attr);
+		ASSERT(w[i].tid != NOTHREAD);
+	}
+	for(int i=0; i<n; i++) {
+		Mutex_Lock(&w[i].mx);
+		while(w[i].state == 0)
+			Cond_Wait(&w[i].mx, &w[i].cv);
+		Mutex_Unlock(&w[i].mx);
+	}
+}
+
+/* Release n waiters, and join them */
+static void idle_stop(idle_waiter* w, int n)
+{
+	for(int i=0; i<n; i++) {
+		Mutex_Lock(&w[i].mx);
+		w[i].state = 2;
+		Cond_Signal(&w[i].cv);
+		Mutex_Unlock(&w[i].mx);
+	}
+	for(int i=0; i<n; i++)
+		ASSERT(ThreadJoin(w[i].tid, NULL)==0);
+}
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Scheduler benchmarks
+ *
+ *
+ *
+ *********************************************/
+
+
+/*
+	bench_context_switch
+
+	Measure the latency of a context switch, in a ping-pong between two
+	contexts. First, two bare CPU contexts switch to each other directly
+	with cpu_swap_context(); then two tinyos threads on one core alternate
+	by calling yield(), which adds the cost of the scheduler. For the latter,
+	the system calls that program the core timer are also counted.
+ */
+
+#define SWITCH_ROUNDS 1000000
+#define SWITCH_STACK (64*1024)
+
+static cpu_context_t ping_ctx, pong_ctx;
+
+static void pong_func()
+{
+	while(1)
+		cpu_swap_context(&pong_ctx, &ping_ctx);
+}
+
+static double switch_time;
+
+static int switch_thread(int argl, void* args)
+{
+	for(int i=0; i<SWITCH_ROUNDS; i++)
+		yield(SCHED_USER);
+	return 0;
+}
+
+static int switch_boot(int argl, void* args)
+{
+	switch_time = run_threads(2, switch_thread, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_context_switch,
+	"Measure the latency of a context switch, with and without\n"
+	"the scheduler.",
+	.timeout = 120
+	)
+{
+	void* stack = malloc(SWITCH_STACK);
+	cpu_initialize_context(&pong_ctx, stack, SWITCH_STACK, pong_func);
+
+	double t0 = clock_ns();
+	for(int i=0; i<SWITCH_ROUNDS; i++)
+		cpu_swap_context(&ping_ctx, &pong_ctx);
+	double t = clock_ns() - t0;
+	free(stack);
+	MSG("cpu_swap_context: %8.1f ns/switch\n", t / (2*SWITCH_ROUNDS));
+
+	boot(1, 0, switch_boot, 0, NULL);
+	MSG("yield:            %8.1f ns/switch\n", switch_time / (2*SWITCH_ROUNDS));
+
+	/* Each timer reset used to be a system call */
+	timer_stats ts;
+	bios_timer_stats(&ts);
+	MSG("timer resets:     %8.3f /switch, host timer syscalls: %.4f /switch, spurious ALARMs: %lu\n",
+		(double)ts.set / (2*SWITCH_ROUNDS), (double)ts.programmed / (2*SWITCH_ROUNDS), ts.spurious);
+}
+
+
+/*
+	bench_sched_trace
+
+	Measure the cost of recording scheduler events, with the yield ping-pong
+	of bench_context_switch, where each switch records two events. The 
+	kernel is booted without a trace file, with one where recording is 
+	turned off at runtime, and with one where it stays on. The trace is 
+	written to /dev/null. Each case reports the best of three runs.
+ */
+
+static int trace_switch_boot(int argl, void* args)
+{
+	sched_trace(argl);
+	return switch_boot(0, NULL);
+}
+
+BARE_TEST(bench_sched_trace,
+	"Measure the cost of recording scheduler events.",
+	.timeout = 120
+	)
+{
+	/* The difference is small, keep the best of a few alternating runs */
+	boot_options opts = { .trace_file = "/dev/null" };
+	double untraced = 1E9, traced[2] = { 1E9, 1E9 };
+	for(int rep=0; rep<3; rep++) {
+		boot(1, 0, switch_boot, 0, NULL);
+		if(switch_time / (2*SWITCH_ROUNDS) < untraced)
+			untraced = switch_time / (2*SWITCH_ROUNDS);
+		for(int on=0; on<2; on++) {
+			boot_with_options(1, 0, trace_switch_boot, on, NULL, &opts);
+			if(switch_time / (2*SWITCH_ROUNDS) < traced[on])
+				traced[on] = switch_time / (2*SWITCH_ROUNDS);
+		}
+	}
+
+	MSG("no trace file:  %8.1f ns/switch\n", untraced);
+	MSG("recording off:  %8.1f ns/switch\n", traced[0]);
+	MSG("recording on:   %8.1f ns/switch, %.1f ns/event\n", traced[1], (traced[1] - untraced) / 2);
+}
+
+
+/*
+	bench_sched_select
+
+	Measure the cost of a context switch, while the ready threads sit at
+	lower and lower priorities. Each thread pins its own priority to
+	the level under test before every yield, so that the boosts do not
+	move it.
+ */
+
+#define SELECT_THREADS 4
+#define SELECT_SWITCHES 400000
+
+static int select_level;
+static double select_time;
+
+static int select_thread(int argl, void* args)
+{
+	TCB* self = cur_thread();
+	for(int i=0; i < SELECT_SWITCHES/SELECT_THREADS; i++) {
+		self->priority = select_level;
+		yield(SCHED_USER);
+	}
+	return 0;
+}
+
+static int select_boot(int argl, void* args)
+{
+	select_time = run_threads(SELECT_THREADS, select_thread, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_sched_select,
+	"Measure the cost of a context switch as the ready threads\n"
+	"spread to lower priority levels.",
+	.timeout = 120
+	)
+{
+	int levels[] = { PRIORITY_QUEUES-1, 3*PRIORITY_QUEUES/4, PRIORITY_QUEUES/2, PRIORITY_QUEUES/4, 0 };
+
+	for(int i=0; i < sizeof(levels)/sizeof(int); i++) {
+		select_level = levels[i];
+		boot(1, 0, select_boot, 0, NULL);
+		MSG("priority %4d: %8.1f ns/switch\n", select_level, select_time / SELECT_SWITCHES);
+	}
+}
+
+
+/*
+	bench_sched_scaling
+
+	Measure the scheduling throughput of the whole system, as the
+	number of cores grows. The load is in the spirit of mtask: a number
+	of threads per core, each computing a small Fibonacci number between
+	yields, so that most of the time is spent in the scheduler.
+ */
+
+#define SCALING_THREADS_PER_CORE 4
+#define SCALING_SWITCHES_PER_THREAD 50000
+
+static double scaling_time;
+
+static int scaling_thread(int argl, void* args)
+{
+	for(int i=0; i < SCALING_SWITCHES_PER_THREAD; i++) {
+		fibo(10);
+		yield(SCHED_USER);
+	}
+	return 0;
+}
+
+static int scaling_boot(int argl, void* args)
+{
+	scaling_time = run_threads(argl, scaling_thread, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_sched_scaling,
+	"Measure the scheduler calls and context switches per second of\n"
+	"the system, as the number of cores grows.",
+	.timeout = 300
+	)
+{
+	for(uint ncores=1; ncores <= 8; ncores *= 2) {
+		int nthreads = SCALING_THREADS_PER_CORE * ncores;
+		sched_stats stats = boot_stats(ncores, scaling_boot, nthreads, NULL, NULL);
+		double secs = 1E-9*scaling_time;
+		MSG("cores %d: %10.0f yields/sec %10.0f switches/sec  (steals: %lu)\n", ncores, 
+			stats.yields / secs, stats.switches / secs, stats.steals);
+	}
+}
+
+
+/*
+	bench_sched_timeouts
+
+	Measure the cost of a timed wait, while a large number of other 
+	threads are blocked in timed waits. The waiters park on their own
+	condition variables with long timeouts. Then, two threads ping-pong
+	over a condition variable, each time waiting with an even longer 
+	timeout, so that each wait registers a timeout and each signal 
+	cancels one.
+ */
+
+#define TIMEOUT_WAITERS 10000
+#define TIMEOUT_PINGPONGS 20000
+
+static idle_waiter timeout_parked[TIMEOUT_WAITERS];
+static pingpong timeout_pp;
+static double timeout_time;
+
+static int timeout_pingpong(int argl, void* args)
+{
+	Mutex_Lock(&timeout_pp.mx);
+	for(int i=0; i<TIMEOUT_PINGPONGS; i++) {
+		pingpong_wait(&timeout_pp, argl, 2000000);
+		pingpong_pass(&timeout_pp, argl);
+	}
+	Mutex_Unlock(&timeout_pp.mx);
+	return 0;
+}
+
+static int timeout_boot(int argl, void* args)
+{
+	/* Park the waiters, with timeouts between 1000 and 1100 seconds */
+	for(int i=0; i<TIMEOUT_WAITERS; i++)
+		timeout_parked[i].msec = 1000000 + 10*i;
+	idle_start(timeout_parked, TIMEOUT_WAITERS, NULL);
+
+	/* Measure */
+	pingpong_init(&timeout_pp);
+	timeout_time = run_threads(2, timeout_pingpong, NULL);
+
+	idle_stop(timeout_parked, TIMEOUT_WAITERS);
+	return 0;
+}
+
+BARE_TEST(bench_sched_timeouts,
+	"Measure the cost of a timed wait, with 10000 concurrent timed waiters.",
+	.timeout = 300
+	)
+{
+	boot(1, 0, timeout_boot, 0, NULL);
+	MSG("%d waiters: %8.1f usec per timed wait and signal\n", TIMEOUT_WAITERS, 
+		1E-3 * timeout_time / (2*TIMEOUT_PINGPONGS));
+}
+
+
+/*
+	bench_timer_latency
+
+	Measure how late timed waits wake up. A single thread sleeps with
+	Cond_TimedWait() for 1 to 5 msec, many times, while the other cores
+	are idle, and the lateness of each wakeup is recorded. Then, the
+	whole system idles while one thread sleeps for a second, and the 
+	voluntary context switches of the host threads are counted, to see
+	how often idle cores wake up.
+ */
+
+#define LATENCY_SAMPLES 500
+
+static double latency[LATENCY_SAMPLES];
+static long idle_wakeups;
+
+static int latency_boot(int argl, void* args)
+{
+	for(int i=0; i<LATENCY_SAMPLES; i++) {
+		timeout_t msec = 1 + i%5;
+		double t0 = clock_ns();
+		sleep_msec(msec);
+		latency[i] = (clock_ns() - t0) / 1000.0 - 1000.0*msec;
+	}
+
+	long sw0 = host_switches();
+	sleep_msec(1000);
+	idle_wakeups = host_switches() - sw0;
+
+	return 0;
+}
+
+BARE_TEST(bench_timer_latency,
+	"Measure the lateness of timed waits, and the wakeups of idle cores.",
+	.timeout = 120
+	)
+{
+	for(uint ncores = 1; ncores <= 4; ncores *= 2) {
+		boot(ncores, 0, latency_boot, 0, NULL);
+		qsort(latency, LATENCY_SAMPLES, sizeof(double), cmp_double);
+		MSG("%u cores: timeout lateness p50 %6.0f  p90 %6.0f  p99 %6.0f  max %6.0f usec, %4ld wakeups/sec idle\n",
+			ncores,
+			latency[LATENCY_SAMPLES/2], latency[LATENCY_SAMPLES*9/10], 
+			latency[LATENCY_SAMPLES*99/100], latency[LATENCY_SAMPLES-1],
+			idle_wakeups);
+	}
+}
+
+
+/*
+	bench_pipe_pingpong
+
+	Measure the wakeup latency, as the round-trip time of a byte between
+	two threads, through a pair of pipes. Each thread blocks on its pipe
+	until the other thread writes to it, so each round trip takes two 
+	wakeups. With more than one core, the threads usually wake up on 
+	a different core than the one that wakes them.
+ */
+
+#define PIPE_ROUNDS 20000
+
+static double pipe_rtt[PIPE_ROUNDS];
+
+static pipe_t pipe_ping, pipe_pong;
+
+static int pipe_echo(int argl, void* args)
+{
+	char c;
+	for(int i=0; i<PIPE_ROUNDS; i++) {
+		ASSERT(Read(pipe_ping.read, &c, 1) == 1);
+		ASSERT(Write(pipe_pong.write, &c, 1) == 1);
+	}
+	return 0;
+}
+
+static int pipe_boot(int argl, void* args)
+{
+	ASSERT(Pipe(&pipe_ping) == 0);
+	ASSERT(Pipe(&pipe_pong) == 0);
+	Tid_t t = CreateThread(pipe_echo, 0, NULL);
+
+	char c = 'x';
+	for(int i=0; i<PIPE_ROUNDS; i++) {
+		double t0 = clock_ns();
+		ASSERT(Write(pipe_ping.write, &c, 1) == 1);
+		ASSERT(Read(pipe_pong.read, &c, 1) == 1);
+		pipe_rtt[i] = clock_ns() - t0;
+	}
+
+	ASSERT(ThreadJoin(t, NULL) == 0);
+	return 0;
+}
+
+BARE_TEST(bench_pipe_pingpong,
+	"Measure the round-trip time of a byte between two threads, through\n"
+	"a pair of pipes.",
+	.timeout = 120
+	)
+{
+	for(uint ncores = 1; ncores <= 4; ncores *= 2) {
+		boot(ncores, 0, pipe_boot, 0, NULL);
+
+		double total = 0.0;
+		for(int i=0; i<PIPE_ROUNDS; i++)
+			total += pipe_rtt[i];
+		qsort(pipe_rtt, PIPE_ROUNDS, sizeof(double), cmp_double);
+		MSG("%u cores: round trip mean %7.1f  p50 %7.1f  p99 %7.1f usec\n",
+			ncores, total / PIPE_ROUNDS / 1000.0, 
+			pipe_rtt[PIPE_ROUNDS/2] / 1000.0, pipe_rtt[PIPE_ROUNDS*99/100] / 1000.0);
+	}
+}
+
+
+/*
+	bench_pipe_readers
+
+	Measure the context switches per transfer of a pipe, read by many
+	threads at once. A writer writes one byte at a time, and waits for 
+	the reader that gets it to answer through a second pipe, so that
+	every write finds all the readers waiting. Waking up all of them, 
+	only for one to get the byte, would take a context switch per reader
+	for every byte.
+ */
+
+#define PREADERS 8
+#define PREADERS_BYTES 20000
+
+static pipe_t preaders_pipe, preaders_ack;
+static double preaders_time;
+
+static int preaders_reader(int argl, void* args)
+{
+	char c;
+	while(Read(preaders_pipe.read, &c, 1) == 1)
+		ASSERT(Write(preaders_ack.write, &c, 1) == 1);
+	return 0;
+}
+
+static int preaders_boot(int argl, void* args)
+{
+	Tid_t tid[PREADERS];
+	ASSERT(Pipe(&preaders_pipe) == 0);
+	ASSERT(Pipe(&preaders_ack) == 0);
+
+	double t0 = clock_ns();
+	for(int i=0; i<PREADERS; i++)
+		tid[i] = CreateThread(preaders_reader, i, NULL);
+
+	char c = 'x';
+	for(int i=0; i<PREADERS_BYTES; i++) {
+		ASSERT(Write(preaders_pipe.write, &c, 1) == 1);
+		ASSERT(Read(preaders_ack.read, &c, 1) == 1);
+	}
+	ASSERT(Close(preaders_pipe.write) == 0);
+
+	for(int i=0; i<PREADERS; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	preaders_time = clock_ns() - t0;
+	return 0;
+}
+
+BARE_TEST(bench_pipe_readers,
+	"Measure the context switches per byte of a pipe read by many threads.",
+	.timeout = 300
+	)
+{
+	for(uint ncores = 1; ncores <= 4; ncores *= 2) {
+		sched_stats stats = boot_stats(ncores, preaders_boot, 0, NULL, NULL);
+		MSG("cores %u: %6.2f switches/byte %9.0f bytes/sec\n", ncores, 
+			(double) stats.switches / PREADERS_BYTES, PREADERS_BYTES / (1E-9*preaders_time));
+	}
+}
+
+
+/*
+	bench_cond_broadcast
+
+	Measure the context switches per woken thread of a broadcast, with 
+	and without wait morphing. A thread broadcasts to many waiters while 
+	it holds their mutex, and waits until each of them has woken up and
+	done some work under the mutex. Without wait morphing, the waiters 
+	all wake up at once, and most of them sleep again on the mutex.
+ */
+
+#define BCAST_WAITERS 8
+#define BCAST_ROUNDS 5000
+
+static Mutex bcast_mx;
+static CondVar bcast_cv, bcast_done;
+static int bcast_round, bcast_seen;
+static double bcast_time;
+
+static int bcast_waiter(int argl, void* args)
+{
+	Mutex_Lock(&bcast_mx);
+	for(int r=1; r<=BCAST_ROUNDS; r++) {
+		while(bcast_round < r)
+			Cond_Wait(&bcast_mx, &bcast_cv);
+		fibo(6);
+		if(++bcast_seen == BCAST_WAITERS)
+			Cond_Signal(&bcast_done);
+	}
+	Mutex_Unlock(&bcast_mx);
+	return 0;
+}
+
+static int bcast_boot(int argl, void* args)
+{
+	Tid_t tid[BCAST_WAITERS];
+	bcast_mx = MUTEX_INIT;
+	bcast_cv = bcast_done = COND_INIT;
+	bcast_round = bcast_seen = 0;
+
+	for(int i=0; i<BCAST_WAITERS; i++)
+		tid[i] = CreateThread(bcast_waiter, i, NULL);
+
+	double t0 = clock_ns();
+	Mutex_Lock(&bcast_mx);
+	for(int r=1; r<=BCAST_ROUNDS; r++) {
+		bcast_round = r;
+		bcast_seen = 0;
+		Cond_Broadcast(&bcast_cv);
+		while(bcast_seen < BCAST_WAITERS)
+			Cond_Wait(&bcast_mx, &bcast_done);
+	}
+	Mutex_Unlock(&bcast_mx);
+	bcast_time = clock_ns() - t0;
+
+	for(int i=0; i<BCAST_WAITERS; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	return 0;
+}
+
+BARE_TEST(bench_cond_broadcast,
+	"Measure the context switches per woken thread of a broadcast, on\n"
+	"2 to 8 cores, with and without wait morphing.",
+	.timeout = 300
+	)
+{
+	for(int no_morph = 0; no_morph <= 1; no_morph++)
+		for(uint ncores = 2; ncores <= 8; ncores *= 2) {
+			boot_options opts = { .no_wait_morphing = no_morph };
+			sched_stats stats = boot_stats(ncores, bcast_boot, 0, NULL, &opts);
+			MSG("cores %u, %-10s: %6.2f switches/wakeup %9.0f wakeups/sec\n", ncores, 
+				no_morph ? "wake all" : "wait morph",
+				(double) stats.switches / (BCAST_ROUNDS*BCAST_WAITERS),
+				BCAST_ROUNDS*BCAST_WAITERS / (1E-9*bcast_time));
+		}
+}
+
+
+/*
+	bench_symposium
+
+	Measure the context switches per second and the throughput, in bites
+	per second, of a symposium of philosopher threads, with time-slices
+	of a fixed quantum and with adaptive time-slices. The philosophers 
+	compute between their meals, so most time-slices end at the quantum.
+	The symposium prints its progress, which is discarded.
+ */
+
+#define SYMP_PHILOSOPHERS 10
+#define SYMP_BITES 10
+
+static double symp_time;
+
+static int symp_boot(int argl, void* args)
+{
+	symposium_t symp = { .N = SYMP_PHILOSOPHERS, .bites = SYMP_BITES };
+	adjust_symposium(&symp, 2, 0);
+
+	double t0 = clock_ns();
+	ASSERT(Exec(SymposiumOfThreads, sizeof(symp), &symp) != NOPROC);
+	WaitChild(NOPROC, NULL);
+	symp_time = clock_ns() - t0;
+	return 0;
+}
+
+BARE_TEST(bench_symposium,
+	"Measure the context switches per second and the throughput of a\n"
+	"symposium, with fixed and with adaptive time-slices.",
+	.timeout = 300
+	)
+{
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	int devnull = open("/dev/null", O_WRONLY);
+	CHECK(devnull);
+
+	for(uint ncores = 1; ncores <= 4; ncores *= 2)
+		for(int fixed = 1; fixed >= 0; fixed--) {
+			boot_options opts = { .fixed_quantum = fixed };
+			dup2(devnull, 1);
+			sched_stats stats = boot_stats(ncores, symp_boot, 0, NULL, &opts);
+			fflush(stdout);
+			dup2(saved_stdout, 1);
+
+			double secs = 1E-9*symp_time;
+			MSG("cores %d, %-8s slices: %8.0f switches/sec %8.1f bites/sec (%.2f sec)\n", 
+				ncores, fixed ? "fixed" : "adaptive", stats.switches / secs, 
+				SYMP_PHILOSOPHERS * SYMP_BITES / secs, secs);
+		}
+
+	close(devnull);
+	close(saved_stdout);
+}
+
+
+/*
+	bench_balance
+
+	Measure the makespan of equal CPU-bound jobs on 4 cores, spawned in
+	uneven patterns, with and without the load balancer:
+
+	- burst: 3 jobs start on idle cores, and 5 more are spawned while all
+	  cores are busy, so they queue on the core of the spawner;
+	- pinned: 8 jobs are spawned pinned to core 0, and then unpinned, while 
+	  the other cores halt.
+
+	Each job runs for BALANCE_JOB of thread CPU time, so the makespan is
+	as on a real machine, also on a host with fewer processors than cores.
+ */
+
+#define BALANCE_CORES 4
+#define BALANCE_JOBS 8
+#define BALANCE_JOB 100000
+
+static TimerDuration balance_makespan;
+
+static int balance_job(int argl, void* args)
+{
+	TimerDuration start = thread_cpu_time();
+	while(thread_cpu_time() - start < BALANCE_JOB)
+		fibo(15);
+	return 0;
+}
+
+static int balance_boot(int argl, void* args)
+{
+	Tid_t tid[BALANCE_JOBS];
+	TimerDuration t0 = bios_clock();
+
+	if(argl == 0) {
+		/* burst */
+		for(int i=0; i < BALANCE_CORES-1; i++)
+			tid[i] = CreateThread(balance_job, 0, NULL);
+		while(bios_clock() < t0 + 5000);
+		for(int i=BALANCE_CORES-1; i < BALANCE_JOBS; i++)
+			tid[i] = CreateThread(balance_job, 0, NULL);
+	} else {
+		/* pinned */
+		ASSERT(ThreadSetAffinity(ThreadSelf(), 1) == 0);
+		for(int i=0; i < BALANCE_JOBS; i++)
+			tid[i] = CreateThread(balance_job, 0, NULL);
+		for(int i=0; i < BALANCE_JOBS; i++)
+			ASSERT(ThreadSetAffinity(tid[i], ALL_CORES) == 0);
+	}
+
+	for(int i=0; i < BALANCE_JOBS; i++)
+		ASSERT(ThreadJoin(tid[i], NULL) == 0);
+	balance_makespan = bios_clock() - t0;
+	return 0;
+}
+
+BARE_TEST(bench_balance,
+	"Measure the makespan of CPU-bound jobs spawned unevenly on the cores,\n"
+	"with and without the load balancer.",
+	.timeout = 120
+	)
+{
+	const char* pattern[] = { "burst", "pinned" };
+	for(int p = 0; p < 2; p++)
+		for(int off = 1; off >= 0; off--) {
+			boot_options opts = { .no_balancing = off };
+			sched_stats stats = boot_stats(BALANCE_CORES, balance_boot, p, NULL, &opts);
+			MSG("%-6s balancer %-3s: makespan %6.1f msec (ideal %.1f), %lu migrations, %lu steals\n",
+				pattern[p], off ? "off" : "on", balance_makespan / 1000.0,
+				BALANCE_JOBS * BALANCE_JOB / 1000.0 / BALANCE_CORES, stats.migrations, stats.steals);
+		}
+}
+
+
+/*
+	bench_core_parking
+
+	Measure what the idle cores cost the host, with and without core 
+	parking, on 4 cores. First, a single thread sleeps for 1 msec, again
+	and again, for a second, after the other cores have had the time to 
+	park; the voluntary context switches of the host threads and the host
+	CPU time are counted. Then, 4 CPU-bound jobs of BALANCE_JOB are 
+	spawned, and their makespan shows how fast the parked cores are 
+	unparked.
+ */
+
+#define PARKING_SLEEPS 1000
+
+static long parking_wakeups;
+static double parking_cpu;
+static double parking_makespan;
+
+static int parking_boot(int argl, void* args)
+{
+	sleep_msec(2 * PARK_DELAY / 1000);
+
+	long sw0 = host_switches();
+	double cpu0 = host_cpu_time();
+	double t0 = clock_ns();
+	for(int i=0; i<PARKING_SLEEPS; i++)
+		sleep_msec(1);
+	double secs = (clock_ns() - t0) / 1E9;
+	parking_wakeups = (host_switches() - sw0) / secs;
+	parking_cpu = (host_cpu_time() - cpu0) / secs;
+
+	parking_makespan = run_threads(BALANCE_CORES, balance_job, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_core_parking,
+	"Measure the host wakeups and CPU time of a mostly idle system on 4 cores,\n"
+	"with and without core parking, and how fast parked cores take up work.",
+	.timeout = 120
+	)
+{
+	for(int off = 1; off >= 0; off--) {
+		boot_options opts = { .no_parking = off };
+		sched_stats stats = boot_stats(BALANCE_CORES, parking_boot, 0, NULL, &opts);
+		MSG("parking %-3s: %5ld wakeups/sec, %5.1f%% host CPU, makespan %6.1f msec (ideal %.1f), %lu parks, %lu unparks\n",
+			off ? "off" : "on", parking_wakeups, 100.0 * parking_cpu,
+			parking_makespan / 1E6, BALANCE_JOB / 1000.0, stats.parks, stats.unparks);
+	}
+}
+
+
+/*
+	bench_mutex_contention
+
+	Measure the throughput and fairness of a contended mutex, on 4 cores,
+	with 2, 4 and 8 times more threads than cores. Each thread locks the
+	mutex, computes a little in the critical section, unlocks it and 
+	computes a little more, until the time is up. Fairness is reported
+	as the Jain index of the acquisitions of the threads (1.0 when all
+	threads got the mutex equally often) and as the ratio of the fewest 
+	to the most acquisitions of a thread.
+ */
+
+#define CONTENTION_CORES 4
+#define CONTENTION_MSEC 300
+
+static Mutex contention_mx;
+static volatile int contention_stop;
+static long contention_count[8*CONTENTION_CORES];
+
+static int contention_thread(int argl, void* args)
+{
+	long count = 0;
+	while(! contention_stop) {
+		Mutex_Lock(&contention_mx);
+		count++;
+		fibo(8);
+		Mutex_Unlock(&contention_mx);
+		fibo(8);
+	}
+	contention_count[argl] = count;
+	return 0;
+}
+
+static int contention_boot(int argl, void* args)
+{
+	int nthreads = argl;
+	Tid_t tid[nthreads];
+
+	contention_mx = MUTEX_INIT;
+	contention_stop = 0;
+	for(int i=0; i<nthreads; i++)
+		tid[i] = CreateThread(contention_thread, i, NULL);
+
+	sleep_msec(CONTENTION_MSEC);
+	contention_stop = 1;
+
+	for(int i=0; i<nthreads; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	return 0;
+}
+
+BARE_TEST(bench_mutex_contention,
+	"Measure the lock acquisitions per second and the fairness of a mutex,\n"
+	"contended by 2, 4 and 8 threads per core, on 4 cores.",
+	.timeout = 120
+	)
+{
+	for(int k=2; k<=8; k*=2) {
+		int nthreads = k*CONTENTION_CORES;
+		boot(CONTENTION_CORES, 0, contention_boot, nthreads, NULL);
+
+		double sum = 0.0, sumsq = 0.0;
+		long min = contention_count[0], max = contention_count[0];
+		for(int i=0; i<nthreads; i++) {
+			long c = contention_count[i];
+			sum += c;
+			sumsq += (double)c * c;
+			if(c < min) min = c;
+			if(c > max) max = c;
+		}
+		MSG("%2d threads: %9.0f locks/sec, Jain index %.3f, min/max %.3f\n", nthreads,
+			sum / (CONTENTION_MSEC / 1000.0), sum*sum / (nthreads*sumsq), 
+			max ? (double) min / max : 0.0);
+	}
+}
+
+
+/*
+	bench_rwlock_readers
+
+	Measure the throughput of readers of a shared table, as the number
+	of cores grows, with a reader-writer lock and with a mutex. There is 
+	one thread per core, pinned to it, which reads the table under the 
+	lock, and updates it once every RWBENCH_WRITE_EVERY reads. Every few 
+	reads, a thread also counts the readers inside the lock, to show how
+	many of them share it. On a host with fewer processors than cores, 
+	the throughput cannot grow with the cores, but the readers can still
+	share the lock.
+ */
+
+#define RWBENCH_ROUNDS 200000
+#define RWBENCH_WRITE_EVERY 1000
+#define RWBENCH_TABLE 16
+
+static RWLock rwbench_rw;
+static Mutex rwbench_mx;
+static int rwbench_table[RWBENCH_TABLE];
+static struct { volatile int inside; } __attribute__((aligned(64))) rwbench_flag[4];
+static unsigned long rwbench_samples, rwbench_shared;
+static double rwbench_time;
+
+static int rwbench_thread(int argl, void* args)
+{
+	int use_rwlock = (args != NULL);
+	unsigned long samples = 0, shared = 0;
+	long sum = 0;
+
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u << argl) == 0);
+	for(int i=1; i <= RWBENCH_ROUNDS; i++) {
+		int write = (i % RWBENCH_WRITE_EVERY == 0);
+		if(use_rwlock) {
+			if(write) RWLock_WriteLock(&rwbench_rw); else RWLock_ReadLock(&rwbench_rw);
+		} else
+			Mutex_Lock(&rwbench_mx);
+
+		rwbench_flag[argl].inside = 1;
+		if(i % 64 == 0) {
+			samples++;
+			for(int c=0; c<4; c++)
+				shared += rwbench_flag[c].inside;
+		}
+		for(int k=0; k<RWBENCH_TABLE; k++) {
+			if(write) rwbench_table[k]++;
+			sum += rwbench_table[k] + fibo(6);
+		}
+		rwbench_flag[argl].inside = 0;
+
+		if(use_rwlock) {
+			if(write) RWLock_WriteUnlock(&rwbench_rw); else RWLock_ReadUnlock(&rwbench_rw);
+		} else
+			Mutex_Unlock(&rwbench_mx);
+	}
+
+	__atomic_add_fetch(&rwbench_samples, samples, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&rwbench_shared, shared, __ATOMIC_RELAXED);
+	return (int) (sum & 1);
+}
+
+static int rwbench_boot(int argl, void* args)
+{
+	rwbench_rw = RWLOCK_INIT;
+	rwbench_mx = MUTEX_INIT;
+	rwbench_samples = rwbench_shared = 0;
+
+	rwbench_time = run_threads(argl, rwbench_thread, args);
+	return 0;
+}
+
+BARE_TEST(bench_rwlock_readers,
+	"Measure the reads per second of a read-mostly table, as the number of\n"
+	"cores grows, with a reader-writer lock and with a mutex.",
+	.timeout = 300
+	)
+{
+	for(int use_rwlock = 0; use_rwlock <= 1; use_rwlock++)
+		for(uint ncores=1; ncores <= 4; ncores *= 2) {
+			boot(ncores, 0, rwbench_boot, ncores, use_rwlock ? &rwbench_rw : NULL);
+			double secs = 1E-9*rwbench_time;
+			MSG("%-6s cores %d: %10.0f reads/sec, %.2f threads inside the lock\n",
+				use_rwlock ? "rwlock" : "mutex", ncores, (double) RWBENCH_ROUNDS * ncores / secs,
+				(double) rwbench_shared / rwbench_samples);
+		}
+}
+
+
+/*
+	bench_wakeup_latency
+
+	Measure the tail latency of waking up a thread, when many cores wake
+	up threads of the same core at once. A sleeper thread on core 0 is
+	paired with a waker thread on each other core; the waker signals its
+	sleeper and waits for it to answer. All the wakeups land on the run
+	queue of core 0, so the scheduler spinlocks are contended by all the
+	wakers. The latency of each Cond_Signal() is measured, with the
+	queue-based spinlocks and with plain test-and-set spinlocks.
+ */
+
+#define WAKEUP_ROUNDS 2000
+#define WAKEUP_MAX_CORES 32
+
+static pingpong wakeup_pair[WAKEUP_MAX_CORES];
+static double wakeup_lat[WAKEUP_MAX_CORES*WAKEUP_ROUNDS];
+
+/* The sleeper takes turn 1 of its pair, the waker turn 0 */
+static int wakeup_sleeper(int argl, void* args)
+{
+	pingpong* p = &wakeup_pair[argl];
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u) == 0);
+	Mutex_Lock(&p->mx);
+	for(int i=0; i<WAKEUP_ROUNDS; i++) {
+		pingpong_wait(p, 1, 0);
+		pingpong_pass(p, 1);
+	}
+	Mutex_Unlock(&p->mx);
+	return 0;
+}
+
+static int wakeup_waker(int argl, void* args)
+{
+	pingpong* p = &wakeup_pair[argl];
+	double* lat = &wakeup_lat[(argl-1)*WAKEUP_ROUNDS];
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u << argl) == 0);
+	Mutex_Lock(&p->mx);
+	for(int i=0; i<WAKEUP_ROUNDS; i++) {
+		double t0 = clock_ns();
+		pingpong_pass(p, 0);
+		lat[i] = clock_ns() - t0;
+		pingpong_wait(p, 0, 0);
+	}
+	Mutex_Unlock(&p->mx);
+	return 0;
+}
+
+static int wakeup_boot(int argl, void* args)
+{
+	int ncores = argl;
+	Tid_t tid[2*WAKEUP_MAX_CORES];
+
+	for(int c=1; c<ncores; c++)
+		pingpong_init(&wakeup_pair[c]);
+	for(int c=1; c<ncores; c++) {
+		tid[2*c] = CreateThread(wakeup_sleeper, c, NULL);
+		tid[2*c+1] = CreateThread(wakeup_waker, c, NULL);
+	}
+	for(int c=1; c<ncores; c++) {
+		ASSERT(ThreadJoin(tid[2*c], NULL)==0);
+		ASSERT(ThreadJoin(tid[2*c+1], NULL)==0);
+	}
+	return 0;
+}
+
+BARE_TEST(bench_wakeup_latency,
+	"Measure the tail latency of waking up threads on one core, from\n"
+	"all the other cores, with queue-based and test-and-set spinlocks.",
+	.timeout = 600
+	)
+{
+	for(uint ncores = 16; ncores <= WAKEUP_MAX_CORES; ncores *= 2)
+		for(int tas = 0; tas <= 1; tas++) {
+			boot_options opts = { .tas_spinlocks = tas };
+			boot_with_options(ncores, 0, wakeup_boot, ncores, NULL, &opts);
+
+			int n = (ncores-1)*WAKEUP_ROUNDS;
+			qsort(wakeup_lat, n, sizeof(double), cmp_double);
+			MSG("%2u cores, %-4s spinlocks: p50 %7.1f  p99 %7.1f  p99.9 %8.1f  max %8.1f usec\n",
+				ncores, tas ? "TAS" : "MCS",
+				wakeup_lat[n/2] / 1000.0, wakeup_lat[n*99/100] / 1000.0,
+				wakeup_lat[n*999/1000] / 1000.0, wakeup_lat[n-1] / 1000.0);
+		}
+}
+
+
+/*
+	bench_syscall_scaling
+
+	Measure the system call throughput of the whole system, as the number
+	of cores grows. There is one thread per core, pinned to it, which calls
+	GetPid and ThreadSelf, and writes and reads back a small message on a 
+	pipe of its own. None of these calls touch state shared with the other
+	threads, so they need not wait for each other.
+ */
+
+#define SYSCALL_ROUNDS 50000
+#define SYSCALL_MSG 64
+
+static double syscall_time;
+
+static int syscall_thread(int argl, void* args)
+{
+	pipe_t p;
+	char buf[SYSCALL_MSG] = { 0 };
+
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u << argl) == 0);
+	ASSERT(Pipe(&p) == 0);
+	for(int i=0; i < SYSCALL_ROUNDS; i++) {
+		ASSERT(GetPid() == 1);
+		ASSERT(ThreadSelf() != NOTHREAD);
+		ASSERT(Write(p.write, buf, SYSCALL_MSG) == SYSCALL_MSG);
+		ASSERT(Read(p.read, buf, SYSCALL_MSG) == SYSCALL_MSG);
+	}
+	Close(p.read);
+	Close(p.write);
+	return 0;
+}
+
+static int syscall_boot(int argl, void* args)
+{
+	syscall_time = run_threads(argl, syscall_thread, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_syscall_scaling,
+	"Measure the system calls per second of the system, as the number of\n"
+	"cores grows, when the calls of each core touch different objects.",
+	.timeout = 300
+	)
+{
+	for(uint ncores=1; ncores <= 4; ncores *= 2) {
+		boot(ncores, 0, syscall_boot, ncores, NULL);
+		double secs = 1E-9*syscall_time;
+		MSG("cores %d: %10.0f syscalls/sec\n", ncores, 4.0 * SYSCALL_ROUNDS * ncores / secs);
+	}
+}
+
+
+/*
+	bench_thread_create
+
+	Measure the cost of creating and joining a thread, in batches of
+	threads that do nothing. This is done once with a per-core thread 
+	cache of a single block, so that most threads get a fresh stack, and
+	once with the default cache.
+ */
+
+#define CREATE_BATCH 16
+#define CREATE_THREADS 40000
+
+static double create_time;
+
+static int create_thread(int argl, void* args)
+{
+	return argl;
+}
+
+static int create_boot(int argl, void* args)
+{
+	Tid_t tid[CREATE_BATCH];
+
+	double t0 = clock_ns();
+	for(int i=0; i < CREATE_THREADS/CREATE_BATCH; i++) {
+		for(int j=0; j<CREATE_BATCH; j++)
+			tid[j] = CreateThread(create_thread, j, NULL);
+		for(int j=0; j<CREATE_BATCH; j++) {
+			int exitval;
+			ASSERT(ThreadJoin(tid[j], &exitval)==0);
+			ASSERT(exitval == j);
+		}
+	}
+	create_time = clock_ns() - t0;
+
+	return 0;
+}
+
+BARE_TEST(bench_thread_create,
+	"Measure the cost of creating and joining a thread, with and\n"
+	"without caching thread stacks.",
+	.timeout = 120
+	)
+{
+	boot_options opts = { .thread_cache = 1 };
+	boot_with_options(1, 0, create_boot, 0, NULL, &opts);
+	MSG("cache size %3lu: %8.1f ns/thread\n", opts.thread_cache, create_time / CREATE_THREADS);
+
+	boot(1, 0, create_boot, 0, NULL);
+	MSG("cache size %3d: %8.1f ns/thread\n", THREAD_CACHE_SIZE, create_time / CREATE_THREADS);
+}
+
+
+/*
+	bench_thread_churn
+
+	Measure the cost of creating and joining a thread on 4 cores, where 
+	4 threads create and join batches of threads at the same time. The 
+	threads exit on every core, so that every core keeps switching away 
+	from exited threads.
+ */
+
+#define CHURN_CORES 4
+
+static int churn_creator(int argl, void* args)
+{
+	Tid_t tid[CREATE_BATCH];
+
+	for(int i=0; i < CREATE_THREADS/CREATE_BATCH/CHURN_CORES; i++) {
+		for(int j=0; j<CREATE_BATCH; j++)
+			tid[j] = CreateThread(create_thread, j, NULL);
+		for(int j=0; j<CREATE_BATCH; j++)
+			ASSERT(ThreadJoin(tid[j], NULL)==0);
+	}
+	return 0;
+}
+
+static int churn_boot(int argl, void* args)
+{
+	create_time = run_threads(CHURN_CORES, churn_creator, NULL);
+	return 0;
+}
+
+BARE_TEST(bench_thread_churn,
+	"Measure the cost of creating and joining threads, on 4 cores\n"
+	"at the same time.",
+	.timeout = 120
+	)
+{
+	boot(CHURN_CORES, 0, churn_boot, 0, NULL);
+	MSG("%d cores: %8.1f ns/thread\n", CHURN_CORES, create_time / CREATE_THREADS);
+}
+
+
+/*
+	bench_thread_memory
+
+	Measure the resident memory of idle threads. A number of threads are
+	created, each of which blocks on its own condition variable, and the 
+	growth of the resident set of the program is reported. The stack pages
+	are only committed as they are used, so this should be close to the
+	TCB and the few stack pages that a blocked thread has touched, 
+	regardless of the stack size.
+
+	Note that each thread takes two memory mappings (the guard page and the
+	rest), so many more threads need a larger vm.max_map_count.
+ */
+
+#define MEMORY_THREADS 20000
+
+static idle_waiter memory_idle[MEMORY_THREADS];
+
+static unsigned int memory_stack;
+static double memory_growth;
+
+/* The resident set size of this program, in bytes */
+static double resident_size()
+{
+	FILE* f = fopen("/proc/self/statm", "r");
+	ASSERT(f != NULL);
+	unsigned long size, resident;
+	ASSERT(fscanf(f, "%lu %lu", &size, &resident) == 2);
+	fclose(f);
+	return (double) resident * sysconf(_SC_PAGESIZE);
+}
+
+static int memory_boot(int argl, void* args)
+{
+	thread_attr attr = { .stack_size = memory_stack };
+
+	double rss0 = resident_size();
+	idle_start(memory_idle, MEMORY_THREADS, &attr);
+	memory_growth = resident_size() - rss0;
+
+	idle_stop(memory_idle, MEMORY_THREADS);
+	return 0;
+}
+
+BARE_TEST(bench_thread_memory,
+	"Measure the resident memory of idle threads, for different\n"
+	"stack sizes.",
+	.timeout = 120
+	)
+{
+	unsigned int stacks[] = { 16*1024, 128*1024, 1024*1024 };
+
+	for(int i=0; i < sizeof(stacks)/sizeof(stacks[0]); i++) {
+		memory_stack = stacks[i];
+		boot(1, 0, memory_boot, 0, NULL);
+		MSG("%d threads, stack %5u KiB: %6.1f KiB resident per thread\n", 
+			MEMORY_THREADS, memory_stack/1024, memory_growth / 1024 / MEMORY_THREADS);
+	}
+}
+
+
+TEST_SUITE(sched_benchmarks,
+	"Benchmarks of the scheduler."
+	)
+{
+	&bench_context_switch,
+	&bench_sched_trace,
+	&bench_sched_select,
+	&bench_sched_scaling,
+	&bench_sched_timeouts,
+	&bench_timer_latency,
+	&bench_pipe_pingpong,
+	&bench_pipe_readers,
+	&bench_cond_broadcast,
+	&bench_symposium,
+	&bench_balance,
+	&bench_core_parking,
+	&bench_mutex_contention,
+	&bench_rwlock_readers,
+	&bench_wakeup_latency,
+	&bench_syscall_scaling,
+	&bench_thread_create,
+	&bench_thread_churn,
+	&bench_thread_memory,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Main program
+ *
+ *
+ *
+ *********************************************/
+
+
+TEST_SUITE(all_benchmarks,
+	"A suite containing all benchmarks.")
+{
+	&sched_benchmarks,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
+
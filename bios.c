@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -52,6 +53,13 @@ typedef struct core
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	_Atomic int restart_pending;	/* A restart arrived, while not halted */
+
+	/* The core timer, see bios_set_timer() */
+	volatile TimerDuration vt_deadline;	/* Deadline of the core timer, or 0 */
+	volatile TimerDuration hw_deadline;	/* Deadline of the host timer, or 0 */
+	timer_stats tstats;
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -180,6 +188,11 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->restart_pending = 0;
+
+	/* The timer is disarmed */
+	core->vt_deadline = 0;
+	core->hw_deadline = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -309,6 +322,64 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 
 
 
+/* Monotonic clock, the clock of the core timers */
+static TimerDuration get_monotonic_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
+
+/*
+	The core timer is virtual: bios_set_timer() only records the deadline in
+	vt_deadline. The host timer is reprogrammed (a system call) only when
+	the new deadline is earlier than the one it is armed for, or it is not
+	armed. When the host timer expires early, for a deadline that has since
+	been moved or canceled, the ALARM is dropped and the host timer is 
+	armed again for the current deadline, if any.
+
+	The deadlines are only accessed by the core itself, but possibly from
+	its signal handler, in the middle of bios_set_timer(). Both sides only
+	ever arm the host timer for the current value of vt_deadline, so
+	an interleaving can at worst cause a redundant system call or an ALARM 
+	that is dropped.
+ */
+
+/* Arm the host timer of the core, for an absolute deadline (0 to disarm) */
+static void vtimer_program(Core* core, TimerDuration deadline)
+{
+	struct itimerspec newtime = {
+		.it_value = {.tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000l},
+		.it_interval = {.tv_sec=0, .tv_nsec=0}
+	};
+
+	core->hw_deadline = deadline;
+	core->tstats.programmed++;
+	CHECK(timer_settime(core->timer_id, TIMER_ABSTIME, &newtime, NULL));
+}
+
+/* 
+	Called for an ALARM, after the host timer has expired. Return 1 if the
+	core timer has expired, else rearm the host timer as needed and return 0.
+ */
+static int vtimer_expired(Core* core)
+{
+	core->hw_deadline = 0;
+
+	TimerDuration deadline = core->vt_deadline;
+	if(deadline != 0 && get_monotonic_time() >= deadline) {
+		core->vt_deadline = 0;
+		return 1;
+	}
+
+	core->tstats.spurious++;
+	if(deadline != 0)
+		vtimer_program(core, deadline);
+	return 0;
+}
+
+
 /*
 	Dispatch any pending interrupts, lowest first.
 	Cease if an interrupt causes core change.
@@ -323,6 +394,10 @@ static inline void dispatch_interrupts(Core* core)
 		if(! intr_fetch_lowest(core, &irq)) break;
 	
 		assert(0 <= irq  && irq < maximum_interrupt_no);
+
+		/* Drop the ALARMs of timers that have been reset */
+		if(irq == ALARM && ! vtimer_expired(core)) continue;
+
 #if defined(CORE_STATISTICS)
 		core->irq_delivered[irq]++;
 #endif
@@ -371,7 +446,6 @@ static TimerDuration get_coarse_time()
 }
 
 
-
 /*
 	An io_device handles a file descriptor that is connected to some
 	'peripheral' in stream (byte-oriented) mode. The file descriptor must be
@@ -905,6 +979,7 @@ void vm_run(vm_config* vmc)
 		/* Initialize Core */
 		CORE[c].bootfunc = vmc->bootfunc;
 		CORE[c].id = c;
+		CORE[c].tstats = (timer_stats){ 0 };
 
 
 #if defined(CORE_STATISTICS)
@@ -992,37 +1067,47 @@ uint cpu_cores()
 
 
 
-void cpu_core_halt()
+/*
+	Halt the current core until an interrupt arrives, a restart is 
+	requested, or the timeout expires. A NULL timeout means no timeout.
+ */
+static void core_halt(const struct timespec* timeout)
 {
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
 
+	/* Do not let a stale host timer wake us up */
+	if(core->vt_deadline == 0 && core->hw_deadline != 0)
+		vtimer_program(core, 0);
+
 #if defined(CORE_STATISTICS)
 	TimerDuration stime0 = get_coarse_time();
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+	/* A restart that came before the halt bit was set is not lost */
+	if(! __atomic_exchange_n(& core->restart_pending, 0, __ATOMIC_SEQ_CST)) {
 
-	/* Sleep for 10 msec */
-	int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-		
+		siginfo_t info;
+		int rc = (timeout==NULL) 
+			? sigwaitinfo(&sigusr1_set, &info)
+			: sigtimedwait(&sigusr1_set, &info, timeout);
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		if(rc>0) {
+			/* Got signal, dispatch */
+			dispatch_interrupts(core);
+		}
+		else {
+			assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		}
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1035,6 +1120,36 @@ void cpu_core_halt()
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 }
 
+
+void cpu_core_halt()
+{
+	/* Sleep for 10 msec */
+	struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+	core_halt(&halt_time);
+}
+
+
+void cpu_core_relax()
+{
+	sched_yield();
+}
+
+
+void cpu_core_halt_until(TimerDuration deadline)
+{
+	if(deadline == CPU_NO_DEADLINE) {
+		core_halt(NULL);
+		return;
+	}
+
+	TimerDuration now = get_monotonic_time();
+	if(deadline <= now) return;
+
+	TimerDuration usec = deadline - now;
+	struct timespec halt_time = {.tv_sec = usec / 1000000, .tv_nsec = (usec % 1000000) * 1000l};
+	core_halt(&halt_time);
+}
+
 static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
@@ -1052,12 +1167,22 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+/*
+	Restart core c, even if it is just about to halt. 
+ */
+static void __core_restart_sticky(uint c)
 {
+	__atomic_store_n(& CORE[c].restart_pending, 1, __ATOMIC_SEQ_CST);
 	__core_restart(c);
 }
 
 
+void cpu_core_restart(uint c)
+{
+	__core_restart_sticky(c);
+}
+
+
 void cpu_core_restart_one()
 {
 	/* Only restart if core_id < physical_cores */
@@ -1074,7 +1199,7 @@ void cpu_core_restart_one()
 void cpu_core_restart_all()
 {
 	for(uint c=0; c < ncores; c++)
-		__core_restart(c);
+		__core_restart_sticky(c);
 }
 
 void cpu_core_barrier_sync()
@@ -1116,6 +1241,86 @@ void cpu_enable_interrupts()
 }
 
 
+#ifdef CPU_NATIVE_CONTEXT
+
+/*
+	The native context switch for x86-64.
+
+	A saved context is its stack pointer. The stack holds, from the top
+	down, the return address into the switched-out code, the callee-saved 
+	registers of the System V ABI (rbp, rbx, r12-r15) and a word with the 
+	SSE and x87 control registers (mxcsr, fpu cw), which are also 
+	callee-saved.
+
+	A new context is set up to "return" into cpu_context_start, with the
+	thread function in rbx.
+ */
+
+void cpu_context_start();
+
+__asm__ (
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.globl cpu_swap_context\n"
+	"	.type cpu_swap_context, @function\n"
+	"cpu_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size cpu_swap_context, .-cpu_swap_context\n"
+	"\n"
+	"	.p2align 4\n"
+	"	.type cpu_context_start, @function\n"
+	"cpu_context_start:\n"
+	"	xorl %ebp, %ebp\n"
+	"	callq *%rbx\n"
+	"	callq abort\n"
+	"	.size cpu_context_start, .-cpu_context_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The stack pointer must be 16-byte aligned right after the 'ret' into
+	   cpu_context_start, so that the 'call' sees an ABI-aligned stack. */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*)(top - 16);
+
+	*--sp = (uint64_t) cpu_context_start; /* return address */
+	*--sp = 0;                            /* rbp */
+	*--sp = (uint64_t) ctx_func;          /* rbx */
+	*--sp = 0;                            /* r12 */
+	*--sp = 0;                            /* r13 */
+	*--sp = 0;                            /* r14 */
+	*--sp = 0;                            /* r15 */
+	*--sp = 0;
+	/* Start with the control registers of the caller */
+	__asm__ ("stmxcsr %0" : "=m" (((uint32_t*)sp)[0]));
+	__asm__ ("fnstcw %0" : "=m" (((uint16_t*)sp)[2]));
+
+	ctx->sp = sp;
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1138,6 +1343,7 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
 
 
 /*
@@ -1147,20 +1353,27 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 
 TimerDuration bios_set_timer(TimerDuration usec)
 {
-	time_t sec = usec / 1000000;
-	long nsec = (usec % 1000000) * 1000ull;
-	
-	struct itimerspec newtime = {
-		.it_value = {.tv_sec=sec, .tv_nsec=nsec},
-		.it_interval = {.tv_sec=0, .tv_nsec=0}
-	};
+	Core* core = curr_core();
+	core->tstats.set++;
 
-	struct itimerspec oldtime;
-	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
+	TimerDuration now = get_monotonic_time();
+	TimerDuration old = core->vt_deadline;
+	TimerDuration remaining = (old > now) ? old - now : 0;
+
+	if(usec == 0) {
+		/* The host timer is left armed; its ALARM will be dropped */
+		core->vt_deadline = 0;
+		return remaining;
+	}
+
+	TimerDuration deadline = now + usec;
+	core->vt_deadline = deadline;
 
-	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
-	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
+	TimerDuration hw = core->hw_deadline;
+	if(hw == 0 || deadline < hw)
+		vtimer_program(core, deadline);
+
+	return remaining;
 }
 
 TimerDuration bios_cancel_timer()
@@ -1169,9 +1382,20 @@ TimerDuration bios_cancel_timer()
 }
 
 
+void bios_timer_stats(timer_stats* total)
+{
+	*total = (timer_stats){ 0 };
+	for(uint c=0; c < MAX_CORES; c++) {
+		total->set += CORE[c].tstats.set;
+		total->programmed += CORE[c].tstats.programmed;
+		total->spurious += CORE[c].tstats.spurious;
+	}
+}
+
+
 TimerDuration bios_clock()
 {
-	return get_coarse_time();
+	return get_monotonic_time();
 }	
 
 
@@ -378,14 +378,54 @@ void cpu_enable_interrupts();
 
 	This function is useful when a core becomes idle. An idle core does not
 	consume simulation resources (in particular CPU time).
+
+	The core may also restart spuriously, currently after at most 10 msec.
+
+	@see cpu_core_halt_until
 */
 void cpu_core_halt();
 
 
+/**
+	@brief Tell the core that it is spinning on a busy wait.
+
+	The simulated cores share the host CPUs, and the core that the busy
+	wait is waiting for may not be running. This call gives up the host
+	CPU for a moment, so that the other cores can go on.
+*/
+void cpu_core_relax();
+
+
+/**
+	@brief A deadline for @c cpu_core_halt_until that never expires.
+ */
+#define CPU_NO_DEADLINE ((TimerDuration)-1)
+
+/**
+	@brief Halt the core until an interrupt arrives, or until a deadline.
+
+	This function will block the core on which it is called, until an interrupt
+	arrives for the core, the core is restarted, or the time given by 
+	@c bios_clock() reaches @c deadline. Unlike @c cpu_core_halt(), the
+	core does not restart periodically, so an idle core that passes 
+	@c CPU_NO_DEADLINE stays halted until it is interrupted or restarted.
+
+	A restart by @c cpu_core_restart() or @c cpu_core_restart_all() that
+	arrives while the core is running, is remembered, and the next halt
+	returns immediately. This allows a core to check for work and then
+	halt, without losing a restart that arrives in between.
+
+	@param deadline the time to restart at, or @c CPU_NO_DEADLINE
+	@see bios_clock
+*/
+void cpu_core_halt_until(TimerDuration deadline);
+
+
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. If it was not, 
+	the next halt of the core will return immediately.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -405,10 +445,34 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use the native context switch.
+
+	On x86-64, contexts are switched by a few lines of assembly, which save
+	only the callee-saved registers and the stack pointer. Elsewhere, or if
+	@c CPU_UCONTEXT is defined at compile time, the (much slower) 
+	@c ucontext functions are used.
+
+	Unlike @c swapcontext, the native switch does not save and restore the
+	signal mask. The signal mask is a property of the core, not of the 
+	context, therefore contexts must only be switched while interrupts
+	are disabled, and a new context starts with the signal mask of the
+	core that first switches to it.
+*/
+#if defined(__x86_64__) && !defined(CPU_UCONTEXT)
+#define CPU_NATIVE_CONTEXT
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#ifdef CPU_NATIVE_CONTEXT
+typedef struct {
+	void* sp;		/**< @brief The stack pointer; the registers are saved on the stack */
+} cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -428,7 +492,7 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	@brief Switch the CPU context.
 
 	Save the current context into @c oldctx and load the contents of @c newctx
-	into the CPU.
+	into the CPU. This must be called with interrupts disabled.
 
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
@@ -447,6 +511,10 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 	(that is, 10,000 microseconds). After the interval expires, the
 	core receives an ALARM interrupt.
 
+	The core timer is kept in memory, and the timer of the host is only
+	reprogrammed when the new deadline is earlier than the one it is 
+	armed for. Therefore, resetting the timer is cheap.
+
 	This function can be called even if the timer is already activated;
 	in this case, the previous timer countdown is canceled and the timer resets
 	to the new value.
@@ -470,16 +538,39 @@ TimerDuration bios_set_timer(TimerDuration usec);
 TimerDuration bios_cancel_timer();
 
 
+/**
+	@brief Counters of the core timers.
+
+	@see bios_timer_stats
+ */
+typedef struct timer_stats {
+	unsigned long set; /**< @brief Calls to @c bios_set_timer() and @c bios_cancel_timer() */
+	unsigned long programmed; /**< @brief Reprogrammings of the host timer (system calls) */
+	unsigned long spurious; /**< @brief ALARMs dropped, because the timer was reset */
+} timer_stats;
+
+
+/**
+	@brief Get the counters of the core timers.
+
+	The counters of all cores are summed into @c total. The counters are
+	reset when the VM boots, and remain valid after it halts.
+
+	@param total the counters to fill in
+ */
+void bios_timer_stats(timer_stats* total);
+
+
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
+	This function returns a monotonic clock value, in usec, from
+	an arbitrary origin. It is the clock of the core timers, so it
+	does not jump when the host time is adjusted, and deadlines
+	computed from it remain valid.
 
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	The resolution of the clock is that of the host monotonic clock,
+	usually 1 usec.
  */
 TimerDuration bios_clock();
 
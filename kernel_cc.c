@@ -24,45 +24,247 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	sleeping mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
+
+ 	The lock byte is 0 when the mutex is free, 1 when it is locked and 2
+ 	when it is locked and threads may be sleeping on it, as in a futex.
+ 	A thread in the preemptive domain spins for a while (only if there is
+ 	another core, where the holder may be running), and then sleeps on a 
+ 	wait queue. The wait queues are kept outside the mutex, in a hash table
+ 	of buckets indexed by the address of the mutex, each protected by a 
+ 	spinlock. When a mutex with sleepers is unlocked, the first of them is
+ 	woken up to take it, in FIFO order. Other threads may take the mutex
+ 	first, which keeps the throughput up, but a sleeper that has waited 
+ 	for too long gets the mutex handed to it, and wakes up holding it.
+
+ 	The mutex records its holder. A thread that sleeps waiting lends
+ 	its priority to the holder, which gets its own priority back when it
+ 	unlocks (see inherit_priority()).
+ */
+
+/** \cond HELPER A thread sleeping on a mutex. */
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of a bucket ring */
+	Mutex* mutex;				/* the mutex waited for */
+	TCB* thread;				/* thread to wait */
+	TimerDuration start;		/* when the thread started waiting */
+	sig_atomic_t handed;		/* set when the mutex is handed to the thread */
+	int queued;					/* set while the waiter is in the bucket ring */
+	int starving;				/* set when the mutex must be handed to the thread */
+} __mutex_waiter;
+
+/* A bucket of the wait queues */
+typedef struct __mutex_bucket {
+	Mutex spinlock;				/* locked with preemption off only */
+	__mutex_waiter* waiters;	/* a ring of waiters, or NULL */
+} __attribute__((aligned(64))) __mutex_bucket;
+/** \endcond */
+
+#define MUTEX_BUCKETS 64
+#define MUTEX_SPINS 1000
+#define MUTEX_HANDOFF_WAIT 1000		/* usec */
+
+static __mutex_bucket mutex_buckets[MUTEX_BUCKETS];
+
+static inline __mutex_bucket* mutex_bucket(Mutex* lock)
+{
+	uintptr_t a = (uintptr_t) lock;
+	return & mutex_buckets[(a ^ (a >> 6) ^ (a >> 12)) % MUTEX_BUCKETS];
+}
+
+/* Find the first waiter on the given mutex in a bucket, or NULL */
+static __mutex_waiter* mutex_first_waiter(__mutex_bucket* b, Mutex* lock)
+{
+	__mutex_waiter* w = b->waiters;
+	if(w) do {
+		if(w->mutex == lock) return w;
+		w = w->node.next->obj;
+	} while(w != b->waiters);
+	return NULL;
+}
+
+/* Add a waiter to the back of the bucket ring, or to the front */
+static void mutex_add_waiter(__mutex_bucket* b, __mutex_waiter* w, int front)
+{
+	rlnode_init(& w->node, w);
+	if(b->waiters) {
+		rlist_push_back(& b->waiters->node, & w->node);
+		if(front) b->waiters = w;
+	} else
+		b->waiters = w;
+	w->queued = 1;
+}
+
+static void mutex_remove_waiter(__mutex_bucket* b, __mutex_waiter* w)
+{
+	if(b->waiters == w) {
+		__mutex_waiter* nextw = w->node.next->obj;
+		b->waiters = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+	w->queued = 0;
+}
+
+/* 
+	Sleep until the mutex is free or handed to us, and take it. 
+
+	A woken thread takes the mutex as contended, since others may still
+	sleep on it. If the mutex was taken meanwhile, it sleeps again, at the
+	head of the queue; once it has waited MUTEX_HANDOFF_WAIT, the mutex
+	is handed to it. 
+
+	A thread that was put in the queue while it slept on a condition 
+	variable (see cv_morph()) enters with woken set; it may also have been 
+	woken by the timeout of its wait, still in the queue.
  */
+static void mutex_wait(Mutex* lock, __mutex_waiter* waiter, int woken)
+{
+	__mutex_bucket* b = mutex_bucket(lock);
+
+	int preempt = preempt_off;
+	while(1) {
+		Mutex_Lock(& b->spinlock);
+		if(waiter->handed) {
+			Mutex_Unlock(& b->spinlock);
+			break;
+		}
+		if(waiter->queued)
+			mutex_remove_waiter(b, waiter);
+
+		/* If nobody else sleeps on it, a free mutex is taken uncontended */
+		char free = 0;
+		if(mutex_first_waiter(b, lock) == NULL && 
+		   __atomic_compare_exchange_n(&lock->lock, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			Mutex_Unlock(& b->spinlock);
+			break;
+		}
+
+		/* Mark the mutex as having sleepers. If it was freed meanwhile, it is ours. */
+		if(__atomic_exchange_n(&lock->lock, 2, __ATOMIC_ACQUIRE) == 0) {
+			Mutex_Unlock(& b->spinlock);
+			break;
+		}
+
+		mutex_add_waiter(b, waiter, woken);
+		if(woken && bios_clock() - waiter->start >= MUTEX_HANDOFF_WAIT)
+			waiter->starving = 1;
+
+		/* Only an unlocking thread wakes us up */
+		sleep_releasing(STOPPED, & b->spinlock, SCHED_MUTEX, NO_TIMEOUT);
+		if(waiter->handed)
+			break;
+		woken = 1;
+		inherit_priority(&lock->owner);
+	}
+	if(preempt) preempt_on;
+}
+
+static void mutex_sleep(Mutex* lock)
+{
+	__mutex_waiter waiter = { .mutex = lock, .thread = cur_thread(), .start = bios_clock() };
+
+	inherit_priority(&lock->owner);
+	mutex_wait(lock, &waiter, 0);
+}
+
 void Mutex_Lock(Mutex* lock)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+  char free = 0;
+  if(__atomic_compare_exchange_n(&lock->lock, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    goto locked;
+
+  if(! cpu_interrupts_enabled()) {
+    /* Non-preemptive domain: pure spinlock */
+    do {
+      while(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED)) {
+#if defined(__x86__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+      }
+      free = 0;
+    } while(! __atomic_compare_exchange_n(&lock->lock, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    goto locked;
+  }
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+  /* Preemptive domain: spin for a while, if the holder may be running on another core */
+  if(cpu_cores() > 1) {
+    for(int spin = MUTEX_SPINS; spin > 0; spin--) {
+      free = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+      if(free == 2) 
+        break;    /* others already sleep, get in line */
+      if(free == 0 && __atomic_compare_exchange_n(&lock->lock, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        goto locked;
 #if defined(__x86__) || defined(__x86_64__)
       __builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
     }
   }
-#undef MUTEX_SPINS
+
+  /* Sleep, until the mutex is ours */
+  mutex_sleep(lock);
+
+locked:
+  __atomic_store_n(&lock->owner, cur_thread(), __ATOMIC_RELAXED);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+  restore_priority(&lock->owner);
+
+  char locked = 1;
+  if(__atomic_compare_exchange_n(&lock->lock, &locked, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return;
+
+  /* There may be sleepers, wake up the first one */
+  __mutex_bucket* b = mutex_bucket(lock);
+  int preempt = preempt_off;
+  Mutex_Lock(& b->spinlock);
+
+  __mutex_waiter* w = mutex_first_waiter(b, lock);
+  if(w && w->starving) {
+    /* Hand the mutex over, keeping it locked */
+    mutex_remove_waiter(b, w);
+    __atomic_store_n(&lock->owner, w->thread, __ATOMIC_RELAXED);
+    if(mutex_first_waiter(b, lock) == NULL)
+      __atomic_store_n(&lock->lock, 1, __ATOMIC_RELAXED);
+    w->handed = 1;
+    wakeup(w->thread);
+  } else {
+    __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
+    if(w) {
+      mutex_remove_waiter(b, w);
+      wakeup(w->thread);
+    }
+  }
+
+  Mutex_Unlock(& b->spinlock);
+  if(preempt) {
+    preempt_on;
+    kick_cores();
+  }
 }
 
 
 /*
 	Condition variables.	
+
+	A waiter records the mutex it waits with. A broadcast wakes up only
+	the first waiter; while the mutex is held, the others are moved to 
+	the wait queue of the mutex instead (wait morphing), and each unlock 
+	of the mutex wakes up one of them. Thus, the waiters do not all become
+	runnable at once, only to sleep again on the mutex. A signal moves 
+	its waiter only if threads already sleep on the mutex, since the 
+	waiter would sleep behind them anyway. With a single core, the woken
+	threads cannot run before the signalling thread sleeps, usually after
+	unlocking the mutex, so there is nothing to gain.
 */
 
 
@@ -73,9 +275,19 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	int morphed;				/* set if moved to the wait queue of the mutex */
+	__mutex_waiter mxwait;		/* the waiter for the mutex */
 } __cv_waiter;
 /** \endcond */
 
+/* Set from the boot options */
+static int wait_morphing = 1;
+
+void initialize_cc(const boot_options* options)
+{
+	wait_morphing = !options->no_wait_morphing && cpu_cores() > 1;
+}
+
 /**
    @internal
    A helper routine to remove a condition waiter from the CondVar ring.
@@ -121,7 +333,8 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0, .morphed=0,
+		.mxwait = { .mutex = mutex, .thread = cur_thread() } };
 	rlnode_init(& waiter.node, &waiter);
 
 	Mutex_Lock(&(cv->waitset_lock));
@@ -147,25 +360,64 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	if(waiter.morphed) {
+		mutex_wait(mutex, &waiter.mxwait, 1);
+		__atomic_store_n(&mutex->owner, cur_thread(), __ATOMIC_RELAXED);
+	} else
+		Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
 
+/**
+  @internal
+  Move a signalled waiter to the wait queue of its mutex, if the mutex 
+  is held, or, if @c contended is set, if threads sleep on it. Returns 0
+  if the waiter was not moved, and must be woken up. Preemption must be off.
+ */
+static int cv_morph(__cv_waiter* waiter, int contended)
+{
+	Mutex* lock = waiter->mxwait.mutex;
+	__mutex_bucket* b = mutex_bucket(lock);
+
+	/* A peek, to save the locks when the waiter will be woken up anyway */
+	char state = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+	if(! wait_morphing || state == 0 || (contended && state != 2))
+		return 0;
+
+	Mutex_Lock(& b->spinlock);
+
+	/* Mark the mutex as having sleepers, unless it is free */
+	state = __atomic_load_n(&lock->lock, __ATOMIC_RELAXED);
+	while(state == 1 && !contended && !__atomic_compare_exchange_n(&lock->lock, &state, 2, 0, 
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if(state == 2 || (state == 1 && !contended)) {
+		waiter->mxwait.start = bios_clock();
+		mutex_add_waiter(b, &waiter->mxwait, 0);
+		waiter->morphed = 1;
+	}
+
+	Mutex_Unlock(& b->spinlock);
+	return waiter->morphed;
+}
+
+
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
-  Else, it leaves the cv->waitset == NULL.
+  Else, it leaves the cv->waitset == NULL. The waiter is moved to the
+  mutex instead of woken up, as decided by @c cv_morph().
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int contended)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(cv_morph(waiter, contended) || wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -186,19 +438,202 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 }
 
 
-void Cond_Signal(CondVar* cv)
+/**
+  @internal
+  Signal or broadcast, without interrupting the cores of the woken
+  threads. This is used by the kernel while it holds its locks; the 
+  cores are interrupted by @c kernel_unlock(), or when the caller sleeps.
+ */
+static void cv_wake(CondVar* cv, int all)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
+  if(cv->waitset) {
+    int preempt = preempt_off;
+    cv_signal(cv, 1);
+    if(all)
+      while(cv->waitset) cv_signal(cv, 0);
+    if(preempt) preempt_on;
+  }
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
 
+void Cond_Signal(CondVar* cv)
+{
+  cv_wake(cv, 0);
+  kick_cores();
+}
+
+
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  cv_wake(cv, 1);
+  kick_cores();
+}
+
+
+
+/*
+	Reader-writer locks.
+	--------------------
+
+	The state word holds the number of readers, and three flags: a writer
+	holds the lock, writers are waiting, readers are waiting. Readers 
+	enter by incrementing it, as long as there is no writer, holding or 
+	waiting; otherwise they back out and wait on the @c readers condition.
+	Writers enter when the state has no readers and no writer; otherwise
+	they wait on the @c writers condition. The waits happen under the 
+	mutex of the lock, and the flags tell the unlocking threads to take 
+	the mutex and wake up the waiters.
+ */
+
+#define RW_WRITER        0x80000000u
+#define RW_WRITERS_WAIT  0x40000000u
+#define RW_READERS_WAIT  0x20000000u
+#define RW_READERS       0x1fffffffu
+
+/* The time left until a deadline, or 0 if it has passed */
+static TimerDuration time_left(TimerDuration deadline)
+{
+	if(deadline == NO_TIMEOUT) return NO_TIMEOUT;
+	TimerDuration now = bios_clock();
+	return (now < deadline) ? deadline - now : 0;
+}
+
+static int rw_read_wait(RWLock* rw, TimerDuration timeout)
+{
+	TimerDuration deadline = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : bios_clock() + timeout;
+	int locked = 0;
+
+	Mutex_Lock(&rw->mx);
+	while(1) {
+		unsigned int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+		if(!(s & (RW_WRITER | RW_WRITERS_WAIT))) {
+			if(__atomic_compare_exchange_n(&rw->state, &s, s+1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				locked = 1;
+				break;
+			}
+			continue;
+		}
+
+		TimerDuration t = time_left(deadline);
+		if(t == 0) break;
+
+		/* Ask the writer to wake us up, when it unlocks */
+		if(!(s & RW_READERS_WAIT) && 
+			!__atomic_compare_exchange_n(&rw->state, &s, s | RW_READERS_WAIT, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		cv_wait(&rw->mx, &rw->readers, SCHED_USER, t);
+	}
+	Mutex_Unlock(&rw->mx);
+	return locked;
+}
+
+static int rw_write_wait(RWLock* rw, TimerDuration timeout)
+{
+	TimerDuration deadline = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : bios_clock() + timeout;
+	int locked = 0;
+
+	Mutex_Lock(&rw->mx);
+	rw->writers_waiting++;
+	__atomic_fetch_or(&rw->state, RW_WRITERS_WAIT, __ATOMIC_RELAXED);
+	while(1) {
+		unsigned int s = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+		if(!(s & (RW_WRITER | RW_READERS))) {
+			unsigned int n = (s | RW_WRITER) & ~RW_WRITERS_WAIT;
+			if(rw->writers_waiting > 1) n |= RW_WRITERS_WAIT;
+			if(__atomic_compare_exchange_n(&rw->state, &s, n, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				locked = 1;
+				break;
+			}
+			continue;
+		}
+
+		TimerDuration t = time_left(deadline);
+		if(t == 0) break;
+		cv_wait(&rw->mx, &rw->writers, SCHED_USER, t);
+	}
+	rw->writers_waiting--;
+
+	if(!locked && rw->writers_waiting == 0) {
+		/* Let in the readers that waited because of us */
+		unsigned int s = __atomic_fetch_and(&rw->state, ~RW_WRITERS_WAIT, __ATOMIC_RELAXED);
+		if((s & RW_READERS_WAIT) && !(s & RW_WRITER)) {
+			__atomic_fetch_and(&rw->state, ~RW_READERS_WAIT, __ATOMIC_RELAXED);
+			Cond_Broadcast(&rw->readers);
+		}
+	}
+	Mutex_Unlock(&rw->mx);
+	return locked;
+}
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+	unsigned int s = __atomic_sub_fetch(&rw->state, 1, __ATOMIC_RELEASE);
+
+	/* The last reader lets a waiting writer in */
+	if((s & (RW_READERS | RW_WRITER)) == 0 && (s & RW_WRITERS_WAIT)) {
+		Mutex_Lock(&rw->mx);
+		Cond_Signal(&rw->writers);
+		Mutex_Unlock(&rw->mx);
+	}
+}
+
+void RWLock_ReadLock(RWLock* rw)
+{
+	unsigned int s = __atomic_fetch_add(&rw->state, 1, __ATOMIC_ACQUIRE);
+	if(!(s & (RW_WRITER | RW_WRITERS_WAIT)))
+		return;
+
+	RWLock_ReadUnlock(rw);
+	rw_read_wait(rw, NO_TIMEOUT);
+}
+
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout)
+{
+	unsigned int s = __atomic_fetch_add(&rw->state, 1, __ATOMIC_ACQUIRE);
+	if(!(s & (RW_WRITER | RW_WRITERS_WAIT)))
+		return 1;
+
+	RWLock_ReadUnlock(rw);
+	/* We have to translate timeout from msec to usec */
+	return rw_read_wait(rw, timeout*1000ul);
+}
+
+void RWLock_WriteLock(RWLock* rw)
+{
+	unsigned int s = 0;
+	if(__atomic_compare_exchange_n(&rw->state, &s, RW_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	rw_write_wait(rw, NO_TIMEOUT);
+}
+
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout)
+{
+	unsigned int s = 0;
+	if(__atomic_compare_exchange_n(&rw->state, &s, RW_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return 1;
+	/* We have to translate timeout from msec to usec */
+	return rw_write_wait(rw, timeout*1000ul);
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+	unsigned int s = RW_WRITER;
+	if(__atomic_compare_exchange_n(&rw->state, &s, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	/* Writers go first, else all the readers go */
+	Mutex_Lock(&rw->mx);
+	if(rw->writers_waiting > 0) {
+		__atomic_fetch_and(&rw->state, ~RW_WRITER, __ATOMIC_RELEASE);
+		Cond_Signal(&rw->writers);
+	} else {
+		s = __atomic_fetch_and(&rw->state, ~(RW_WRITER | RW_READERS_WAIT), __ATOMIC_RELEASE);
+		if(s & RW_READERS_WAIT)
+			Cond_Broadcast(&rw->readers);
+	}
+	Mutex_Unlock(&rw->mx);
 }
 
 
@@ -231,22 +666,43 @@ static int kernel_sem = 1;
 /* Semaphore condition */
 static CondVar kernel_sem_cv = COND_INIT;
 
-void kernel_lock()
+/* The thread holding the semaphore, for priority inheritance */
+static void* kernel_sem_owner = NULL;
+
+/* Acquire and release the semaphore, with kernel_mutex held */
+static void kernel_sem_down()
 {
-	Mutex_Lock(& kernel_mutex);
 	while(kernel_sem<=0) {
+		inherit_priority(&kernel_sem_owner);
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
 	}
 	kernel_sem--;
+	__atomic_store_n(&kernel_sem_owner, cur_thread(), __ATOMIC_SEQ_CST);
+}
+
+static void kernel_sem_up()
+{
+	kernel_sem++;
+	__atomic_store_n(&kernel_sem_owner, NULL, __ATOMIC_SEQ_CST);
+	restore_priority(&kernel_sem_owner);
+	cv_wake(&kernel_sem_cv, 0);
+}
+
+void kernel_lock()
+{
+	Mutex_Lock(& kernel_mutex);
+	kernel_sem_down();
 	Mutex_Unlock(& kernel_mutex);
 }
 
 void kernel_unlock()
 {
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+	kernel_sem_up();
 	Mutex_Unlock(& kernel_mutex);
+
+	/* No locks are held now, run the threads woken up for other cores */
+	kick_cores();
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
@@ -254,35 +710,36 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 {
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	kernel_sem_up();
 
 	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
 
 	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
+	kernel_sem_down();
 	Mutex_Unlock(& kernel_mutex);		
 
 	return ret;
 }
 
+int kernel_wait_mutex(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
 void kernel_signal(CondVar* cv) 
 { 
-	Cond_Signal(cv); 
+	cv_wake(cv, 0); 
 }
 
 void kernel_broadcast(CondVar* cv) 
 { 
-	Cond_Broadcast(cv); 
+	cv_wake(cv, 1); 
 }
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
 	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
+	kernel_sem_up();
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
 }
 
@@ -59,6 +59,16 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable, releasing a mutex.
+
+	This is for kernel objects that are protected by a mutex of their
+	own, instead of the kernel lock. The mutex is unlocked while the
+	thread sleeps, and locked again before this returns.
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_wait_mutex(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, TimerDuration timeout);
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
@@ -81,6 +91,16 @@ void kernel_broadcast(CondVar* cv);
 void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
+/**
+	@brief Initialize concurrency control.
+
+	This function is called during kernel initialization.
+
+	@param options the boot options, where all fields have been set
+ */
+void initialize_cc(const boot_options* options);
+
+
 
 /** @brief Set the preemption status for the current core.
 
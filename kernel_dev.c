@@ -51,7 +51,8 @@ static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
-  .Close = nulldev_close
+  .Close = nulldev_close,
+  .unlocked = 1
 };
 
 
@@ -92,6 +92,14 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Non-zero if Read and Write do their own locking.
+
+      The Read and Write methods of such a stream are called without the
+      kernel lock, so that streams can be used in parallel. The other
+      methods are always called with the kernel lock held.
+     */
+    int unlocked;
 } file_ops;
 
 
@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -26,6 +27,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  boot_options options;
 } boot_rec;
 
 
@@ -38,7 +40,8 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(&boot_rec.options);
+    initialize_cc(&boot_rec.options);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -60,12 +63,37 @@ void boot_tinyos_kernel()
 
 
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_with_options(ncores, nterm, boot_task, argl, args, NULL);
+}
+
+
+void boot_with_options(uint ncores, uint nterm, Task boot_task, int argl, void* args,
+  const boot_options* options)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  /* Fill in the defaults */
+  boot_options defaults = { 0 };
+  boot_rec.options = (options != NULL) ? *options : defaults;
+  if(boot_rec.options.quantum == 0)
+    boot_rec.options.quantum = QUANTUM;
+  if(boot_rec.options.boost_period == 0)
+    boot_rec.options.boost_period = BOOST_PERIOD;
+  if(boot_rec.options.thread_cache == 0)
+    boot_rec.options.thread_cache = THREAD_CACHE_SIZE;
+  if(boot_rec.options.park_delay == 0)
+    boot_rec.options.park_delay = PARK_DELAY;
+  if(boot_rec.options.unpark_depth == 0)
+    boot_rec.options.unpark_depth = UNPARK_DEPTH;
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  /* The VM has stopped, write the scheduler trace */
+  if(boot_rec.options.trace_file != NULL)
+    sched_trace_dump(boot_rec.options.trace_file);
 }
 
 
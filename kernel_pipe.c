@@ -7,14 +7,16 @@ static file_ops pipe_reader_functions = {
 	.Open = pipe_open,
 	.Read = pipe_read,
 	.Write = pipe_illegal_write,
-	.Close = pipe_reader_close
+	.Close = pipe_reader_close,
+	.unlocked = 1
 };
 
 static file_ops pipe_writer_functions = {
 	.Open = pipe_open,
 	.Read = pipe_illegal_read,
 	.Write = pipe_write,
-	.Close = pipe_writer_close
+	.Close = pipe_writer_close,
+	.unlocked = 1
 };
 
 int sys_Pipe(pipe_t* pipe)
@@ -43,6 +45,8 @@ int sys_Pipe(pipe_t* pipe)
 	newPipe_cb->reader = fcb[0];
 	newPipe_cb->writer = fcb[1];
 
+	newPipe_cb->lock = MUTEX_INIT;
+	newPipe_cb->refcount = 2;				/* The two open ends */
 	newPipe_cb->has_space = COND_INIT; 		/* Initialization of the new pipe control block */
 	newPipe_cb->has_data = COND_INIT; 
 	
@@ -78,17 +82,33 @@ int pipe_read(void* this, char *buf, unsigned int size)
 	pipe_cb* pipe_con_block = (pipe_cb*)this;
 	/* if pipe_cb is invalid or reader end is closed 
 	 *if writer is closed we can still read from the pipe*/
-	if(pipe_con_block == NULL || pipe_con_block->reader == NULL)
+	if(pipe_con_block == NULL)
 		return -1;
 
-	/* While pipe is empty and we can't write in it */
-	if(isEmpty(pipe_con_block) && pipe_con_block->writer == NULL)
- 		return 0;  
+	/* The pipe has its own lock, the kernel lock is not held here */
+	Mutex_Lock(&pipe_con_block->lock);
 
-	/* While pipe is empty, we must wait until something is written */
-	while(isEmpty(pipe_con_block)){
+	if(pipe_con_block->reader == NULL){
+		Mutex_Unlock(&pipe_con_block->lock);
+		return -1;
+	}
+
+	/* While pipe is empty, we must wait until something is written, or the writer end is closed */
+	while(isEmpty(pipe_con_block) && pipe_con_block->writer != NULL && pipe_con_block->reader != NULL){
 		kernel_broadcast(&pipe_con_block -> has_space);	/*buffer is empty, wake up writers */
-		kernel_wait(&pipe_con_block -> has_data, SCHED_PIPE);
+		kernel_wait_mutex(&pipe_con_block->lock, &pipe_con_block -> has_data, SCHED_PIPE, NO_TIMEOUT);
+	}
+
+	/* The reader end was closed while we waited (by a socket shutdown) */
+	if(pipe_con_block->reader == NULL){
+		Mutex_Unlock(&pipe_con_block->lock);
+		return -1;
+	}
+
+	/* The writer end is closed and nothing is left to read */
+	if(isEmpty(pipe_con_block)){
+		Mutex_Unlock(&pipe_con_block->lock);
+		return 0;
 	}
 
 	int ctr = 0;			/* Counter for the bytes to return */
@@ -101,7 +121,12 @@ int pipe_read(void* this, char *buf, unsigned int size)
 		pipe_con_block->r_position = (pipe_con_block->r_position + 1) % PIPE_BUFFER_SIZE;	/*Increase r_position of pipe*/
 	}
 	
-	kernel_broadcast(&pipe_con_block -> has_space);			/*wake up writers */
+	/* Wake up one writer, and pass the wakeup on to another reader if data is left */
+	kernel_signal(&pipe_con_block -> has_space);
+	if(!isEmpty(pipe_con_block))
+		kernel_signal(&pipe_con_block -> has_data);
+	Mutex_Unlock(&pipe_con_block->lock);
+	kick_cores();
 
 	return ctr;
 }
@@ -113,12 +138,26 @@ int pipe_write(void* this, const char* buf, unsigned int size)
 
 	/* if pipe_cb is invalid or writer end is closed 
 	 *or reader end is closed(thus we will not be able to read what we wrote)*/
-	if(pipe_con_block == NULL || pipe_con_block->writer == NULL|| pipe_con_block->reader == NULL)
+	if(pipe_con_block == NULL)
+		return -1;
+
+	/* The pipe has its own lock, the kernel lock is not held here */
+	Mutex_Lock(&pipe_con_block->lock);
+
+	if(pipe_con_block->writer == NULL|| pipe_con_block->reader == NULL){
+		Mutex_Unlock(&pipe_con_block->lock);
 		return -1;
+	}
 
-	while(isFull(pipe_con_block)){				
+	while(isFull(pipe_con_block) && pipe_con_block->reader != NULL && pipe_con_block->writer != NULL){				
 		kernel_broadcast(&pipe_con_block -> has_data);	/*buffer is full, wake up readers */
-		kernel_wait(&pipe_con_block -> has_space, SCHED_PIPE);
+		kernel_wait_mutex(&pipe_con_block->lock, &pipe_con_block -> has_space, SCHED_PIPE, NO_TIMEOUT);
+	}
+
+	/* An end was closed while we waited */
+	if(pipe_con_block->writer == NULL || pipe_con_block->reader == NULL){
+		Mutex_Unlock(&pipe_con_block->lock);
+		return -1;
 	}
 
 	int ctr = 0;			/* Counter for the bytes to return */
@@ -132,7 +171,12 @@ int pipe_write(void* this, const char* buf, unsigned int size)
 		pipe_con_block->w_position = (pipe_con_block->w_position + 1) % PIPE_BUFFER_SIZE;	/*Increase w_position of pipe*/
 	}
 
-	kernel_broadcast(&pipe_con_block -> has_data);			/*wake up readers */
+	/* Wake up one reader, and pass the wakeup on to another writer if space is left */
+	kernel_signal(&pipe_con_block -> has_data);
+	if(!isFull(pipe_con_block))
+		kernel_signal(&pipe_con_block -> has_space);
+	Mutex_Unlock(&pipe_con_block->lock);
+	kick_cores();
 
 	return ctr;
 }
@@ -145,14 +189,13 @@ int pipe_reader_close(void* this)
 	if(pipe_con_block == NULL)
 		return -1;
 	
+	Mutex_Lock(&pipe_con_block->lock);
 	pipe_con_block->reader = NULL;		/* Close reader end */
 	kernel_broadcast(& pipe_con_block->has_space);	/*  Wake up the writers */
+	kernel_broadcast(& pipe_con_block->has_data);	/*  and the readers of a shut down socket */
+	Mutex_Unlock(&pipe_con_block->lock);
 
-	if(pipe_con_block->writer == NULL){		/* If both ends are now closed free the pipe*/
-		//pipe_con_block = NULL;
-		free(pipe_con_block);
-	}
-
+	pipe_decref(pipe_con_block);		/* The pipe is freed when it is no longer used */
 	return 0;
 }
 
@@ -164,17 +207,35 @@ int pipe_writer_close(void* this)
 	if(pipe_con_block == NULL)
 		return -1;
 	
+	Mutex_Lock(&pipe_con_block->lock);
 	pipe_con_block->writer = NULL;		/* Close writer end */
 	kernel_broadcast(& pipe_con_block->has_data);	/*  Wake up the readers */
+	kernel_broadcast(& pipe_con_block->has_space);	/*  and the writers of a shut down socket */
+	Mutex_Unlock(&pipe_con_block->lock);
 
-	if(pipe_con_block->reader == NULL){		/* If both ends are now closed free the pipe*/
-		//pipe_con_block = NULL;
-		free(pipe_con_block);
-	}
-
+	pipe_decref(pipe_con_block);		/* The pipe is freed when it is no longer used */
 	return 0;
 }
 
+/*
+  Take a reference to a pipe, so that it is not freed while it is used
+  after its ends are closed. Sockets take one around each Read and Write,
+  which a ShutDown or Close of the socket may race with.
+*/
+void pipe_incref(pipe_cb* pipe_con_block)
+{
+	assert(pipe_con_block != NULL);
+	__atomic_add_fetch(&pipe_con_block->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Drop a reference to a pipe, freeing it if it was the last one */
+void pipe_decref(pipe_cb* pipe_con_block)
+{
+	assert(pipe_con_block != NULL);
+	if(__atomic_sub_fetch(&pipe_con_block->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(pipe_con_block);
+}
+
 /*
 function that checks if pipe buffer is empty
 returns 1 for empty buffer, 0 for non empty buffer
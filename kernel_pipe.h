@@ -8,6 +8,9 @@
 
 typedef struct pipe_control_block {
 
+	Mutex lock;           /* Protects the pipe, instead of the kernel lock */
+	uint refcount;        /* One for each open end, and one for each socket call using the pipe */
+
 	FCB *reader, *writer;
 
 	CondVar has_space;    /* For blocking writer if no space is available */
@@ -25,6 +28,8 @@ int pipe_read(void* this, char *buf, unsigned int size);
 int pipe_write(void* this, const char* buf, unsigned int size);
 int pipe_reader_close(void* this);
 int pipe_writer_close(void* this);
+void pipe_incref(pipe_cb* pipe_con_block);
+void pipe_decref(pipe_cb* pipe_con_block);
 int isEmpty(pipe_cb* pipe_con_block);
 int isFull(pipe_cb* pipe_con_block);
 
@@ -38,6 +38,7 @@ static inline void initialize_PCB(PCB* pcb)
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
+  pcb->FIDT_lock = MUTEX_INIT;
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -150,6 +151,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->weight = PROC_WEIGHT_DEFAULT;
   }
   else
   {
@@ -167,8 +169,14 @@ Pid_t sys_Exec(Task call, int argl, void* args)
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+
+    /* Inherit the scheduling weight */
+    newproc->weight = curproc->weight;
   }
 
+  newproc->runnable = 0;
+  newproc->cpu_time = 0;
+
 
   /* Set the main thread's function */
   newproc->main_task = call;
@@ -189,7 +197,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
    */
   if(call != NULL)
   {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, THREAD_STACK_SIZE);
 /**********************************************************************************************************************/
     PTCB* Ptcb = (PTCB*)xmalloc(sizeof(PTCB));                  /*               Allocates a PTCB-space               */
     Ptcb->task = call;                                          /* \                                                  */
@@ -224,7 +232,26 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent may be changed by Exit, under the kernel lock */
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_RELAXED));
+}
+
+
+int sys_SetProcessWeight(Pid_t pid, unsigned int weight)
+{
+  PCB* pcb;
+  if(pid == NOPROC)
+    pcb = CURPROC;
+  else if(pid < 0 || pid >= MAX_PROC)
+    return -1;
+  else
+    pcb = get_pcb(pid);
+
+  if(pcb == NULL || pcb->pstate != ALIVE || weight < 1 || weight > PROC_WEIGHT_MAX)
+    return -1;
+
+  pcb->weight = weight;
+  return 0;
 }
 
 
@@ -359,6 +386,12 @@ Fid_t sys_OpenInfo()
 
   newProcinfo_cb->pcb_cursor = 0;
 
+  /* The total CPU time, to compute the share of each process */
+  newProcinfo_cb->total_cpu_time = 0;
+  for(int i=0; i<MAX_PROC; i++)
+    if(PT[i].pstate != FREE)
+      newProcinfo_cb->total_cpu_time += PT[i].cpu_time;
+
   return fid[0];
 }
 
@@ -395,10 +428,20 @@ int procinfo_read(void* this, char *buf, unsigned int size)
       process_info_cb->process_info.main_task = PT[process_info_cb->pcb_cursor].main_task;
       process_info_cb->process_info.argl = PT[process_info_cb->pcb_cursor].argl;
 
+      /* Scheduling weight and CPU usage */
+      TimerDuration cpu_time = PT[process_info_cb->pcb_cursor].cpu_time;
+      TimerDuration total = process_info_cb->total_cpu_time;
+      process_info_cb->process_info.weight = PT[process_info_cb->pcb_cursor].weight;
+      process_info_cb->process_info.cpu_time = cpu_time;
+      process_info_cb->process_info.share = (total == 0) ? 0 
+        : (cpu_time >= total) ? 1000000 : cpu_time * 1000000 / total;
+
 
       /* pi_cb->processInfo->args = The first 
       PROCINFO_MAX_ARGS_SIZE bytes of the argument of the main task.  */
-      if(PT[process_info_cb->pcb_cursor].argl <= PROCINFO_MAX_ARGS_SIZE)
+      if(PT[process_info_cb->pcb_cursor].args == NULL)
+        ; /* Nothing to copy, a process may have argl > 0 without args */
+      else if(PT[process_info_cb->pcb_cursor].argl <= PROCINFO_MAX_ARGS_SIZE)
         memcpy(process_info_cb->process_info.args, PT[process_info_cb->pcb_cursor].args, PT[process_info_cb->pcb_cursor].argl);
       else
         memcpy(process_info_cb->process_info.args, PT[process_info_cb->pcb_cursor].args, PROCINFO_MAX_ARGS_SIZE);
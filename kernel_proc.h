@@ -39,6 +39,7 @@ typedef struct process_info_control_block {
 
   procinfo process_info;
   int pcb_cursor;
+  TimerDuration total_cpu_time;   /* The CPU time of all processes when the stream was opened */
 
 } procinfo_cb;
 
@@ -80,12 +81,18 @@ typedef struct process_control_block
                              @c WaitChild() */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  Mutex FIDT_lock;        /**< @brief Protects @c FIDT, which @c Read and @c Write use
+                               without the kernel lock */
 
 /****************************************************************************************************************************/
   rlnode ptcb_list;       /**< @brief List of PTCBs of this process                                                         */ 
   int thread_count;       /**< @brief Number of threads for this process                                                    */
 /****************************************************************************************************************************/
 
+  unsigned int weight;    /**< @brief The scheduling weight, see @c SetProcessWeight */
+  volatile int runnable;  /**< @brief The number of threads that are ready or running, kept in fair-share mode */
+  volatile TimerDuration cpu_time; /**< @brief The CPU time used by the threads of the process */
+
 } PCB;
 
 /***************************************************************************************************************************/
@@ -1,5 +1,7 @@
 
 #include <assert.h>
+#include <limits.h>
+#include <stdio.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
@@ -36,6 +38,19 @@ CCB cctx[MAX_CORES];
 */
 #define CURTHREAD (CURCORE.current_thread)
 
+/*
+	A copy of CURTHREAD in thread-local storage, for cur_thread(). With the
+	local-exec model, it is read by a single %fs-relative load, which cannot
+	be split by a context switch.
+ */
+static _Thread_local TCB* cur_tcb __attribute__((tls_model("local-exec")));
+
+/* Scheduler parameters, set from the boot options */
+static TimerDuration sched_quantum = QUANTUM;
+static TimerDuration sched_boost_period = BOOST_PERIOD;
+static int sched_fair = 0;
+static int sched_fixed_quantum = 0;
+
 
 /*
 	This can be used in the preemptive context to
@@ -43,10 +58,243 @@ CCB cctx[MAX_CORES];
  */
 TCB* cur_thread()
 {
-  int preempt = preempt_off;
-  TCB* cur = CURTHREAD;
-  if(preempt) preempt_on;
-  return cur;
+  return cur_tcb;
+}
+
+
+/*
+	Spinlocks.
+
+	The spinlocks of the scheduler are MCS queue locks. A core takes a 
+	free node of its own, and swaps it into the tail of the lock. If there
+	was a tail, it links the node after it and spins on the node, until
+	the previous holder clears it. Unlock hands the lock to the next node,
+	or swaps the tail back to NULL if there is none.
+
+	With tas_spinlocks, the tail is used as a test-and-set flag instead.
+ */
+
+static int sched_tas_spinlocks = 0;
+
+#define TAS_LOCKED ((spin_node*) 1)
+
+/*
+	The core that holds the lock, or that is next in its queue, may not be
+	running on the host. After SPIN_RELAX pauses, a waiter relaxes the core,
+	so that the stalled core can go on.
+ */
+#define SPIN_RELAX 1000
+
+static inline void spin_pause(unsigned int* spins)
+{
+	if (++*spins % SPIN_RELAX == 0) {
+		cpu_core_relax();
+		return;
+	}
+#if defined(__x86__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/*
+  The caller must have preemption off. This is not asserted: checking the
+  signal mask is a system call, paid on every lock.
+ */
+void spin_lock(Spinlock* lock)
+{
+	unsigned int spins = 0;
+	if (sched_tas_spinlocks) {
+		spin_node* free = NULL;
+		while (!__atomic_compare_exchange_n(&lock->tail, &free, TAS_LOCKED, 0, 
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			while (__atomic_load_n(&lock->tail, __ATOMIC_RELAXED) != NULL)
+				spin_pause(&spins);
+			free = NULL;
+		}
+		return;
+	}
+
+	CCB* core = &cctx[cpu_core_id];
+	unsigned int i = __builtin_ctz(~core->spin_used);
+	assert(i < SPIN_NODES);
+	core->spin_used |= 1u << i;
+
+	spin_node* node = &core->spin_nodes[i];
+	node->next = NULL;
+	node->locked = 1;
+
+	spin_node* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev != NULL) {
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			spin_pause(&spins);
+	}
+	lock->holder = node;
+}
+
+void spin_unlock(Spinlock* lock)
+{
+	if (sched_tas_spinlocks) {
+		__atomic_store_n(&lock->tail, NULL, __ATOMIC_RELEASE);
+		return;
+	}
+
+	CCB* core = &cctx[cpu_core_id];
+	spin_node* node = lock->holder;
+	unsigned int spins = 0;
+	assert(node >= core->spin_nodes && node < core->spin_nodes + SPIN_NODES);
+
+	spin_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		spin_node* tail = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &tail, NULL, 0, 
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			goto done;
+
+		/* A waiter is linking itself after us */
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			spin_pause(&spins);
+	}
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+
+done:
+	core->spin_used &= ~(1u << (node - core->spin_nodes));
+}
+
+
+/*
+	Scheduler tracing.
+
+	When the kernel is booted with a trace file, each core records the 
+	scheduler events that it performs in a ring of its own. Only the core
+	writes its ring, with preemption off, so no locks or atomic operations
+	are needed. A full ring overwrites its oldest events. At shutdown,
+	sched_trace_dump() writes the rings in the Chrome trace-event format.
+ */
+
+#define TRACE_RING_SIZE (1 << 16)
+
+enum trace_type { 
+	TRACE_SWITCH_OUT,	/* arg is the cause of the switch */
+	TRACE_SWITCH_IN,
+	TRACE_WAKEUP,
+	TRACE_SLEEP,		/* arg is the cause of the sleep */
+	TRACE_TIMEOUT,
+	TRACE_BOOST			/* arg is the number of boosts */
+};
+
+typedef struct trace_event {
+	TimerDuration time;		/* from bios_clock() */
+	Tid_t tid;				/* NOTHREAD for idle threads */
+	int pid;
+	unsigned short type, arg;
+} trace_event;
+
+static struct trace_ring {
+	unsigned long head;		/* number of events ever recorded */
+	trace_event* event;
+} trace_ring[MAX_CORES];
+
+/* Set while recording, only if the rings are allocated */
+static volatile int sched_tracing = 0;
+
+static void trace_record(enum trace_type type, TCB* tcb, int arg, TimerDuration now)
+{
+	struct trace_ring* ring = &trace_ring[cpu_core_id];
+	trace_event* e = &ring->event[ring->head++ & (TRACE_RING_SIZE - 1)];
+	e->time = now;
+	e->tid = (tcb != NULL) ? (Tid_t) tcb->ptcb : NOTHREAD;
+	e->pid = (tcb != NULL) ? get_pid(tcb->owner_pcb) : NOPROC;
+	e->type = type;
+	e->arg = arg;
+}
+
+/* The clock is read only while recording */
+#define TRACE(type, tcb, arg, now) \
+	do { if (sched_tracing) trace_record((type), (tcb), (arg), (now)); } while (0)
+
+int sched_trace(int on)
+{
+	if (trace_ring[0].event == NULL)
+		return -1;
+	int was = sched_tracing;
+	sched_tracing = on;
+	return was;
+}
+
+static const char* trace_cause_name[] = {
+	"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "preempt"
+};
+
+/* Print event e of core c, with the separator that precedes it */
+static void trace_print(FILE* f, uint c, const char* sep, const char* name, const char* ph, 
+	TimerDuration ts, trace_event* e)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":0,\"tid\":%u,\"ts\":%lu", 
+		sep, name, ph, c, (unsigned long) ts);
+	if (ph[0] == 'X')
+		fprintf(f, ",\"dur\":%lu", (unsigned long)(e->time - ts));
+	else
+		fprintf(f, ",\"s\":\"t\"");
+
+	fprintf(f, ",\"args\":{\"pid\":%d,\"tid\":\"%#lx\"", e->pid, (unsigned long) e->tid);
+	if (e->type == TRACE_SWITCH_OUT || e->type == TRACE_SLEEP)
+		fprintf(f, ",\"cause\":\"%s\"", trace_cause_name[e->arg]);
+	if (e->type == TRACE_BOOST)
+		fprintf(f, ",\"boosts\":%u", e->arg);
+	fprintf(f, "}}");
+}
+
+int sched_trace_dump(const char* filename)
+{
+	sched_tracing = 0;
+	if (trace_ring[0].event == NULL)
+		return -1;
+
+	FILE* f = fopen(filename, "w");
+	if (f != NULL) {
+		fprintf(f, "{\"traceEvents\":[");
+		const char* sep = "";
+		for (uint c = 0; c < MAX_CORES && trace_ring[c].event != NULL; c++) {
+			fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+				"\"args\":{\"name\":\"core %u\"}}", sep, c, c);
+			sep = ",";
+
+			/* A time slice is the interval from a switch-in to the next switch-out */
+			struct trace_ring* ring = &trace_ring[c];
+			unsigned long first = (ring->head > TRACE_RING_SIZE) ? ring->head - TRACE_RING_SIZE : 0;
+			trace_event* in = NULL;
+			for (unsigned long i = first; i < ring->head; i++) {
+				trace_event* e = &ring->event[i & (TRACE_RING_SIZE - 1)];
+				switch (e->type) {
+				case TRACE_SWITCH_IN: in = e; break;
+				case TRACE_SWITCH_OUT:
+					if (in != NULL && in->tid == e->tid && in->pid == e->pid) {
+						char name[48];
+						if (e->tid == NOTHREAD)
+							snprintf(name, sizeof(name), "idle");
+						else
+							snprintf(name, sizeof(name), "pid %d tid %#lx", e->pid, (unsigned long) e->tid);
+						trace_print(f, c, sep, name, "X", in->time, e);
+					}
+					in = NULL;
+					break;
+				case TRACE_WAKEUP: trace_print(f, c, sep, "wakeup", "i", e->time, e); break;
+				case TRACE_SLEEP: trace_print(f, c, sep, "sleep", "i", e->time, e); break;
+				case TRACE_TIMEOUT: trace_print(f, c, sep, "timeout", "i", e->time, e); break;
+				case TRACE_BOOST: trace_print(f, c, sep, "boost", "i", e->time, e); break;
+				}
+			}
+		}
+		fprintf(f, "\n]}\n");
+		fclose(f);
+	}
+
+	for (uint c = 0; c < MAX_CORES; c++) {
+		free(trace_ring[c].event);
+		trace_ring[c] = (struct trace_ring){ 0, NULL };
+	}
+	return (f != NULL) ? 0 : -1;
 }
 
 
@@ -55,35 +303,46 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  The stack grows downward. Therefore, we allocate the TCB at the top of
+  the memory block used by the thread, and the stack right below it. The
+  lowest page of the block is a guard page, which cannot be accessed.
 
   +-------------+
   |   TCB       |
   +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
 
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  hit the guard page and crash with a seg.fault, before it corrupts other 
+  memory (which makes debugging much easier).
+
+  Disadvantages: The stack cannot grow beyond the size given at thread 
+  creation. Of course, we do not support stack growth anyway!
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  The block is mapped with mmap, so that the host kernel commits the stack 
+  pages only as they are touched, and a mostly idle thread only costs the 
+  memory that it actually uses.
  */
 
 /*
   A counter for active threads. By "active", we mean 'existing',
-  with the exception of idle threads (they don't count).
+  with the exception of idle threads (they don't count). An exited 
+  thread stops counting as soon as it is switched out, even before it
+  is reaped. It is updated atomically.
  */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+static unsigned int active_threads = 0;
+
+/* Keeps threads alive while inherit_priority() looks at them, see there */
+static Spinlock pi_spinlock = SPINLOCK_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -92,31 +351,36 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_GUARD_SIZE + (stack_size) + THREAD_TCB_SIZE)
 
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The pages are committed lazily, and the
+  guard page is made inaccessible, so that a stack overflow is detected 
+  as seg.fault.
  */
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
 void* allocate_thread(size_t size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
+	CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
+
 	return ptr;
 }
 #else
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Use malloc to allocate a thread. This cannot be made easily to 'detect'
+  stack overflow, the guard page is just left unused.
  */
 void free_thread(void* ptr, size_t size) { free(ptr); }
 
@@ -128,10 +392,120 @@ void* allocate_thread(size_t size)
 }
 #endif
 
-/***********************************************************************************************************************/
-#define PRIORITY_QUEUES 2000                                        /* Number of priority queues */
-#define CALLS_FOR_BOOST 2000                                /* Every 2000 calls of yield() boost threads */
-/***********************************************************************************************************************/
+/* The bottom of the stack of a thread */
+static inline void* thread_stack(TCB* tcb) { return ((void*)tcb) - tcb->stack_size; }
+
+/*
+  Each core keeps a cache of free threads with the default stack size, so
+  that spawning a thread usually avoids the host kernel and the page faults
+  of a fresh stack. The cached TCBs form a LIFO list, linked through their
+  first word, so that the most recently used, and probably still warm, 
+  stack is reused first.
+
+  A core caches at most thread_cache_size threads; any more are freed.
+  The cache of a core must only be accessed by that core, in non-preemptive
+  context.
+
+  Exited threads are not freed during the context switch. gain() puts
+  them on the reap list of the core, linked the same way, and they are
+  freed or cached in batches by reap_threads(): when the core spawns a
+  thread (so that their stacks are reused first), when it goes idle, on
+  ALARM, and in gain() once REAP_BATCH of them have piled up.
+ */
+static struct thread_cache {
+	TCB* head; /* the most recently freed thread */
+	unsigned int count; /* the number of threads in the list */
+	TCB* reap; /* the exited threads, waiting to be reaped */
+	unsigned int reaping; /* the number of threads in the reap list */
+} thread_cache[MAX_CORES];
+
+#define REAP_BATCH 32
+
+static unsigned int thread_cache_size = THREAD_CACHE_SIZE;
+
+static void reap_threads();
+
+/* Return a TCB with a stack of the given size */
+static TCB* thread_alloc(size_t stack_size)
+{
+	TCB* tcb = NULL;
+
+	if (stack_size == THREAD_STACK_SIZE) {
+		int preempt = preempt_off;
+		reap_threads();
+		struct thread_cache* tc = &thread_cache[cpu_core_id];
+		tcb = tc->head;
+		if (tcb != NULL) {
+			tc->head = *(TCB**)tcb;
+			tc->count--;
+		}
+		if (preempt)
+			preempt_on;
+	}
+
+	if (tcb == NULL)
+		tcb = allocate_thread(THREAD_SIZE(stack_size)) + THREAD_GUARD_SIZE + stack_size;
+
+	tcb->stack_size = stack_size;
+	return tcb;
+}
+
+static void thread_free(TCB* tcb)
+{
+	free_thread(thread_stack(tcb) - THREAD_GUARD_SIZE, THREAD_SIZE(tcb->stack_size));
+}
+
+/* Free a TCB, or keep it in the cache of this core */
+static void thread_cache_put(TCB* tcb)
+{
+	struct thread_cache* tc = &thread_cache[cpu_core_id];
+	if (tcb->stack_size == THREAD_STACK_SIZE && tc->count < thread_cache_size) {
+		*(TCB**)tcb = tc->head;
+		tc->head = tcb;
+		tc->count++;
+	} else
+		thread_free(tcb);
+}
+
+/*
+  Free or cache the threads in the reap list of this core.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+ */
+static void reap_threads()
+{
+	struct thread_cache* tc = &thread_cache[cpu_core_id];
+	TCB* tcb = tc->reap;
+	if (tcb == NULL)
+		return;
+	tc->reap = NULL;
+	tc->reaping = 0;
+
+	/* Wait for any inherit_priority() that may still be looking at these threads */
+	spin_lock(&pi_spinlock);
+	spin_unlock(&pi_spinlock);
+
+	while (tcb != NULL) {
+		TCB* next = *(TCB**)tcb;
+#ifndef NVALGRIND
+		VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+		thread_cache_put(tcb);
+		tcb = next;
+	}
+}
+
+/* Free all the threads cached by this core */
+static void thread_cache_drain()
+{
+	struct thread_cache* tc = &thread_cache[cpu_core_id];
+	while (tc->head != NULL) {
+		TCB* tcb = tc->head;
+		tc->head = *(TCB**)tcb;
+		thread_free(tcb);
+	}
+	tc->count = 0;
+}
 
 /*
   This is the function that is used to start normal threads.
@@ -148,217 +522,1363 @@ static void thread_start()
 	assert(0);
 }
 
-/*
-  Initialize and return a new TCB
-*/
+/*
+  Initialize and return a new TCB
+*/
+
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* The allocated thread size must be a multiple of page size */
+	if (stack_size < THREAD_STACK_MIN)
+		stack_size = THREAD_STACK_MIN;
+	stack_size = (stack_size + SYSTEM_PAGE_SIZE - 1) & ~(size_t)(SYSTEM_PAGE_SIZE - 1);
+
+	TCB* tcb = thread_alloc(stack_size);
+
+	/* Set the owner */
+	tcb->owner_pcb = pcb;
+
+	/* Initialize the other attributes */
+	tcb->type = NORMAL_THREAD;
+	tcb->state = INIT;
+	tcb->phase = CTX_CLEAN;
+	tcb->thread_func = func;
+	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->state_spinlock = SPINLOCK_INIT;
+	tcb->affinity = ALL_CORES;
+	tcb->rt = 0;
+	tcb->vruntime = 0;
+	tcb->last_core = cpu_core_id;
+	tcb->migrated = 0;
+	tcb->cpu_time = 0;
+	tcb->rq = NULL;
+	tcb->pi_lock = NULL;
+	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+
+	tcb->its = sched_quantum;
+	tcb->rts = sched_quantum;
+	tcb->last_cause = SCHED_IDLE;
+	tcb->curr_cause = SCHED_IDLE;
+
+/***********************************************************************************************************************/
+  tcb->priority = PRIORITY_QUEUES-1; /* The first time a thread is executed, it is placed at the highest priority queue */
+/*********************************************************************************************************************/
+
+	/* Compute the stack segment address and size */
+	void* sp = thread_stack(tcb);
+
+	/* Init the context */
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
+
+#ifndef NVALGRIND
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
+#endif
+
+	/* increase the count of active threads */
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+
+	return tcb;
+}
+
+static void rt_release_bandwidth(TCB* tcb);
+
+/*
+  This is called by gain(), on the core that switched away from the
+  exited thread. The thread is put on the reap list of the core, to be
+  freed later by reap_threads().
+ */
+void release_TCB(TCB* tcb)
+{
+	if (tcb->rt)
+		rt_release_bandwidth(tcb);
+
+	struct thread_cache* tc = &thread_cache[cpu_core_id];
+	*(TCB**)tcb = tc->reap;
+	tc->reap = tcb;
+	tc->reaping++;
+
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+/*
+  Each core has its own run queue (CCB::rq), a multilevel queue of
+  doubly linked lists, protected by its own spinlock. A core pushes the
+  threads that it makes ready into its own run queue, and selects the
+  next thread to run from it. Only when it would otherwise run its idle
+  thread, a core tries to steal a thread from the run queue of another
+  core.
+
+  The state and phase of each thread are protected by the thread's
+  state_spinlock.
+
+  Also, the scheduler contains a timer wheel holding all the sleeping
+  threads with a timeout, protected by @c timeout_spinlock.
+
+  To avoid deadlocks, the locks are always taken in the order
+     timeout_spinlock -> TCB::state_spinlock -> run_queue::lock
+  and no core ever holds two run queue locks at the same time.
+*/
+
+/*
+  The timer wheel.
+
+  Time is divided in ticks of 2^TIMER_TICK_SHIFT microseconds. A thread 
+  whose timeout expires at tick e is placed in one of TIMER_WHEEL_LEVELS
+  arrays of TIMER_WHEEL_SLOTS lists, depending on how far e is from the
+  current tick: level l holds the timeouts that are less than 
+  TIMER_WHEEL_SLOTS^(l+1) ticks away, in the slot given by the l-th group
+  of TIMER_WHEEL_BITS bits of e.
+
+  Level 0 slots expire as the ticks pass. Whenever the current tick
+  crosses into a new group of TIMER_WHEEL_SLOTS^l ticks, the matching
+  slot of level l is 'cascaded', i.e., its threads are placed again into
+  lower levels. Thus, both inserting and cancelling a timeout is O(1).
+
+  Bit s of map[l] is set if slot[l][s] may be non-empty. Cancelling does
+  not clear the bit; empty slots are noticed when the wheel advances.
+
+  A thread expires at the first tick that starts no earlier than its
+  wakeup time, so it is never woken up before its timeout.
+*/
+#define TIMER_TICK_SHIFT 10 /* a tick is 1024 usec */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+static struct {
+	rlnode slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t map[TIMER_WHEEL_LEVELS];
+	TimerDuration now; /* the next tick to process */
+	unsigned int count; /* the number of threads in the wheel */
+
+	/* A lower bound to the next tick with work to do, read without the lock by yield() */
+	volatile TimerDuration next;
+} timer_wheel;
+
+Spinlock timeout_spinlock = SPINLOCK_INIT; /* spinlock for timer_wheel */
+
+/* 
+  Place tcb in the wheel, according to its wakeup time.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_insert(TCB* tcb)
+{
+	TimerDuration now = timer_wheel.now;
+	TimerDuration e = (tcb->wakeup_time + (1 << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+	if (e < now)
+		e = now;
+
+	/* Timeouts beyond the wheel's range wait at its last level, and are placed again when cascaded */
+	TimerDuration delta = e - now;
+	if (delta >= 1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+		e = now + (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ull << (TIMER_WHEEL_BITS * (level + 1)))
+		level++;
+	int s = (e >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+
+	rlist_push_back(&timer_wheel.slot[level][s], &tcb->sched_node);
+	timer_wheel.map[level] |= 1ull << s;
+	timer_wheel.count++;
+
+	/* Threads above level 0 need attention at the next cascade */
+	TimerDuration event = (level == 0) ? e : (now + TIMER_WHEEL_SLOTS - 1) & ~(TimerDuration)(TIMER_WHEEL_SLOTS - 1);
+	if (event < timer_wheel.next)
+		timer_wheel.next = event;
+}
+
+/*
+  Remove tcb from the wheel.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_cancel(TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	timer_wheel.count--;
+}
+
+/* Place again the threads of slot[level][s] */
+static void timer_wheel_cascade(int level, int s)
+{
+	if (!(timer_wheel.map[level] & (1ull << s)))
+		return;
+	timer_wheel.map[level] &= ~(1ull << s);
+
+	rlnode list;
+	rlnode_init(&list, NULL);
+	rlist_append(&list, &timer_wheel.slot[level][s]);
+
+	while (!is_rlist_empty(&list)) {
+		TCB* tcb = rlist_pop_front(&list)->tcb;
+		timer_wheel.count--;
+		timer_wheel_insert(tcb);
+	}
+}
+
+/* Move the threads of level-0 slots in mask to list */
+static void timer_wheel_expire(uint64_t mask, rlnode* list)
+{
+	mask &= timer_wheel.map[0];
+	timer_wheel.map[0] &= ~mask;
+	while (mask) {
+		int s = __builtin_ctzll(mask);
+		mask &= mask - 1;
+		rlist_append(list, &timer_wheel.slot[0][s]);
+	}
+}
+
+/*
+  Advance the wheel past tick 'target', moving all expired threads to list.
+  The threads remain counted in the wheel, until they are cancelled.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_advance(TimerDuration target, rlnode* list)
+{
+	const TimerDuration M = TIMER_WHEEL_SLOTS - 1;
+
+	while (timer_wheel.now <= target) {
+		TimerDuration now = timer_wheel.now;
+
+		if (timer_wheel.count == 0) {
+			timer_wheel.now = target + 1;
+			break;
+		}
+
+		/* At the start of each level-0 round, cascade the higher levels */
+		if ((now & M) == 0) {
+			for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				int s = (now >> (TIMER_WHEEL_BITS * level)) & M;
+				timer_wheel_cascade(level, s);
+				if (s != 0)
+					break;
+			}
+		}
+
+		/* Expire the ticks up to the end of the round, or the target */
+		TimerDuration last = (target < (now | M)) ? target : (now | M);
+		timer_wheel_expire((~0ull << (now & M)) & (~0ull >> (M - (last & M))), list);
+		timer_wheel.now = last + 1;
+	}
+
+	/* Compute the next tick with work to do */
+	if (timer_wheel.count == 0)
+		timer_wheel.next = NO_TIMEOUT;
+	else {
+		TimerDuration now = timer_wheel.now;
+		uint64_t later = timer_wheel.map[0] & (~0ull << (now & M));
+		if ((now & M) == 0 || later == 0)
+			timer_wheel.next = (now + M) & ~M;
+		else
+			timer_wheel.next = (now & ~M) + __builtin_ctzll(later);
+	}
+}
+
+static inline void rq_map_set(run_queue* rq, int q)
+{
+	rq->map[q >> 6] |= 1ull << (q & 63);
+	rq->summary |= 1ull << (q >> 6);
+}
+
+static inline void rq_map_clear(run_queue* rq, int q)
+{
+	if ((rq->map[q >> 6] &= ~(1ull << (q & 63))) == 0)
+		rq->summary &= ~(1ull << (q >> 6));
+}
+
+/* Return the highest non-empty queue below limit, or -1 if there is none */
+static inline int rq_map_highest_below(run_queue* rq, int limit)
+{
+	if (limit <= 0)
+		return -1;
+	int w = (limit - 1) >> 6;
+	uint64_t word = rq->map[w] & (~0ull >> (63 - ((limit - 1) & 63)));
+	if (word)
+		return (w << 6) + 63 - __builtin_clzll(word);
+
+	uint64_t lower = rq->summary & ((1ull << w) - 1);
+	if (lower == 0)
+		return -1;
+	w = 63 - __builtin_clzll(lower);
+	return (w << 6) + 63 - __builtin_clzll(rq->map[w]);
+}
+
+/* Return the queue holding priority level l */
+static inline int rq_index(run_queue* rq, int l)
+{
+	int q = l + rq->base;
+	return (q < PRIORITY_QUEUES) ? q : q - PRIORITY_QUEUES;
+}
+
+_Static_assert(RUN_QUEUE_MAP_WORDS <= 64, "run_queue::summary cannot cover all the map words");
+
+/*
+  Fair-share mode.
+
+  Each thread has a virtual runtime, which advances as the thread runs, 
+  at a rate inversely proportional to the share of the thread: the weight
+  of its process, divided by the number of runnable threads of the 
+  process. Each core runs the thread with the least virtual runtime, 
+  so that every process gets CPU time in proportion to its weight, and
+  splits it equally among its threads.
+
+  Virtual runtimes are compared as signed differences, so that they may
+  wrap around.
+ */
+
+static inline int vruntime_before(TimerDuration a, TimerDuration b) { return (long)(a - b) < 0; }
+
+/* The virtual runtime of a thread that ran for the given time */
+static inline TimerDuration fair_charge(TCB* tcb, TimerDuration ran)
+{
+	PCB* pcb = tcb->owner_pcb;
+	int runnable = pcb->runnable;
+	if (runnable < 1)
+		runnable = 1;
+	return tcb->vruntime + ran * PROC_WEIGHT_DEFAULT * runnable / pcb->weight;
+}
+
+/*
+  Insert tcb into rq, in order of virtual runtime. A thread that has been
+  asleep gets at most one quantum of credit over the threads of rq, so 
+  that it cannot monopolize the core when it wakes up. 
+
+  The list is searched from the back, where the threads that have just 
+  run usually go.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static void fair_push(run_queue* rq, TCB* tcb)
+{
+	TimerDuration floor = rq->min_vruntime - sched_quantum;
+	if (vruntime_before(tcb->vruntime, floor))
+		tcb->vruntime = floor;
+
+	rlnode* p = rq->fair_queue.prev;
+	while (p != &rq->fair_queue && vruntime_before(tcb->vruntime, p->tcb->vruntime))
+		p = p->prev;
+	rl_splice(p, &tcb->sched_node);
+	rq->count++;
+}
+
+/*
+  Remove and return the thread of rq with the least virtual runtime among
+  those whose affinity intersects mask, and which have not been migrated
+  after time settled, or NULL if there is none.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static TCB* fair_pop_for(run_queue* rq, coremask_t mask, TimerDuration settled)
+{
+	for (rlnode* p = rq->fair_queue.next; p != &rq->fair_queue; p = p->next)
+		if ((p->tcb->affinity & mask) && p->tcb->migrated <= settled) {
+			rlist_remove(p);
+			rq->count--;
+			return p->tcb;
+		}
+	return NULL;
+}
+
+/*
+  Advance the virtual clock of rq, as thread next starts to run. The clock
+  follows the least virtual runtime of the threads of the core, and never
+  goes back.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static void fair_update_min(run_queue* rq, TCB* next)
+{
+	TimerDuration v = next->vruntime;
+	if (!is_rlist_empty(&rq->fair_queue) && vruntime_before(rq->fair_queue.next->tcb->vruntime, v))
+		v = rq->fair_queue.next->tcb->vruntime;
+	if (vruntime_before(rq->min_vruntime, v))
+		rq->min_vruntime = v;
+}
+
+/*
+  Add TCB to the end of its priority queue in rq.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static void rq_push(run_queue* rq, TCB* tcb)
+{
+	if (sched_fair) {
+		fair_push(rq, tcb);
+		return;
+	}
+
+	int q = rq_index(rq, tcb->priority);
+	rlist_push_back(&rq->queue[q], &tcb->sched_node);
+	rq_map_set(rq, q);
+	rq->count++;
+	tcb->rq = rq;
+}
+
+/*
+  Remove node p from queue q of rq and return its thread. The priority of
+  the thread is updated to the level of q, which accounts for the boosts
+  it received while queued.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static TCB* rq_remove(run_queue* rq, int q, rlnode* p)
+{
+	rlist_remove(p);
+	if (is_rlist_empty(&rq->queue[q]))
+		rq_map_clear(rq, q);
+	rq->count--;
+
+	TCB* tcb = p->tcb;
+	tcb->priority = (q >= rq->base) ? q - rq->base : q - rq->base + PRIORITY_QUEUES;
+	tcb->rq = NULL;
+	return tcb;
+}
+
+/*
+  Return the queue of rq that holds tcb. The list of tcb is followed up to
+  its head, which is one of the queues.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static int rq_queue_of(run_queue* rq, TCB* tcb)
+{
+	rlnode* p = tcb->sched_node.next;
+	while (p < &rq->queue[0] || p >= &rq->queue[PRIORITY_QUEUES])
+		p = p->next;
+	return p - rq->queue;
+}
+
+/*
+  Remove and return the head of the highest non-empty queue in rq,
+  or NULL if rq is empty. The priority of the returned thread is updated
+  to the level it was found at, which accounts for the boosts it received
+  while queued.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static TCB* rq_pop(run_queue* rq)
+{
+	if (sched_fair)
+		return fair_pop_for(rq, ALL_CORES, NO_TIMEOUT);
+
+	/* Levels wrap around the end of the array, the top ones are below base */
+	int q = rq_map_highest_below(rq, rq->base);
+	if (q < 0)
+		q = rq_map_highest_below(rq, PRIORITY_QUEUES);
+	if (q < 0)
+		return NULL;
+
+	return rq_remove(rq, q, rq->queue[q].next);
+}
+
+/*
+  Remove and return the highest-priority thread in rq that may run on
+  the given core, and which has not been migrated by the load balancer
+  after time settled, or NULL if there is none. The queues are searched 
+  in order, so this takes longer when the threads at the top are pinned
+  to other cores.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static TCB* rq_pop_for(run_queue* rq, uint core, TimerDuration settled)
+{
+	coremask_t bit = 1u << core;
+	if (sched_fair)
+		return fair_pop_for(rq, bit, settled);
+
+	/* First the levels below base, which are the top ones, then the rest */
+	for (int limit = rq->base, lowest = 0; ; limit = PRIORITY_QUEUES, lowest = rq->base) {
+		for (int q = rq_map_highest_below(rq, limit); q >= lowest; q = rq_map_highest_below(rq, q)) {
+			for (rlnode* p = rq->queue[q].next; p != &rq->queue[q]; p = p->next)
+				if ((p->tcb->affinity & bit) && p->tcb->migrated <= settled)
+					return rq_remove(rq, q, p);
+		}
+		if (limit == PRIORITY_QUEUES)
+			return NULL;
+	}
+}
+
+/*
+  Move all threads of each queue in rq to the immediately higher one.
+
+  This is done in constant time: the threads of the top level are moved
+  to the front of the level below it, and then the mapping of levels to
+  queues is rotated by one, so that every queue moves one level up and 
+  the emptied top queue becomes the lowest level. The priorities of the 
+  queued threads are fixed when they are popped.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static void rq_boost(run_queue* rq)
+{
+	int top = rq_index(rq, PRIORITY_QUEUES - 1);
+	int below = rq_index(rq, PRIORITY_QUEUES - 2);
+
+	if (!is_rlist_empty(&rq->queue[top])) {
+		rlist_prepend(&rq->queue[below], &rq->queue[top]);
+		rq_map_clear(rq, top);
+		rq_map_set(rq, below);
+	}
+
+	rq->base = (rq->base == 0) ? PRIORITY_QUEUES - 1 : rq->base - 1;
+}
+
+static void sched_balance();
+
+/* Interrupt handler for ALARM */
+void yield_handler() 
+{ 
+	reap_threads();
+	sched_balance();
+	yield(SCHED_QUANTUM); 
+}
+
+/* Interrupt handle for inter-core interrupts, sent when a thread is queued for this core */
+void ici_handler() { yield(SCHED_PREEMPT); }
+
+static void sched_restart_timer_core();
+
+/*
+  Possibly add TCB to the scheduler timeout list.
+
+  *** MUST BE CALLED WITH timeout_spinlock AND tcb->state_spinlock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+
+		/* An empty wheel can skip ahead to the current tick */
+		if (timer_wheel.count == 0)
+			timer_wheel.now = curtime >> TIMER_TICK_SHIFT;
+
+		/* add to the timer wheel */
+		TimerDuration next = timer_wheel.next;
+		timer_wheel_insert(tcb);
+
+		/* Idle cores may be halted until a later deadline */
+		if (timer_wheel.next < next)
+			sched_restart_timer_core();
+	}
+}
+
+/*
+  The time of the earliest timeout, or a lower bound of it. This is read
+  without the lock, by idle cores, to decide how long to halt.
+*/
+static TimerDuration sched_next_deadline()
+{
+	TimerDuration next = timer_wheel.next;
+	return (next == NO_TIMEOUT) ? CPU_NO_DEADLINE : next << TIMER_TICK_SHIFT;
+}
+
+/*
+  Real-time threads.
+
+  Each real-time thread is bound to a core (rt_core), and is kept in the 
+  run queue of that core: in rt_queue, ordered by deadline, when it can 
+  run, or in rt_throttled, ordered by release time, when it has used up
+  the budget of its job. Threads are never stolen from these queues.
+
+  The budget is managed as a constant bandwidth server: a job gets 
+  rt_runtime usec of budget and a deadline rt_deadline usec after its 
+  start. A thread that wakes up with budget left keeps its job, unless 
+  the remaining budget could not be used up before the deadline without
+  exceeding the bandwidth of the thread, in which case a new job starts.
+
+  Admission control keeps the bandwidth of the real-time threads of each 
+  core within RT_BANDWIDTH_MAX, under rt_spinlock.
+ */
+
+static Spinlock rt_spinlock = SPINLOCK_INIT;
+
+/* The number of real-time threads, read without a lock */
+static volatile unsigned int rt_threads = 0;
+
+/* The bandwidth of a real-time thread, in ppm, rounded up */
+static inline unsigned long rt_bandwidth(TimerDuration runtime, TimerDuration period)
+{
+	return (runtime * 1000000 + period - 1) / period;
+}
+
+/* Give back the bandwidth of a real-time thread */
+static void rt_release_bandwidth(TCB* tcb)
+{
+	spin_lock(&rt_spinlock);
+	cctx[tcb->rt_core].rq.rt_bandwidth -= rt_bandwidth(tcb->rt_runtime, tcb->rt_period);
+	rt_threads--;
+	spin_unlock(&rt_spinlock);
+}
+
+/* Start a new job at time t */
+static inline void rt_new_job(TCB* tcb, TimerDuration t)
+{
+	tcb->rt_abs_deadline = t + tcb->rt_deadline;
+	tcb->rt_release = t + tcb->rt_period;
+	tcb->rt_budget = tcb->rt_runtime;
+}
+
+/* 
+  The constant bandwidth server rule, applied when a thread wakes up at
+  time now: keep the current job, if it can still be served in time. 
+  A throttled thread waits for its release.
+ */
+static void rt_wakeup(TCB* tcb, TimerDuration now)
+{
+	if (tcb->rt_budget <= 0 && now < tcb->rt_release)
+		return;
+
+	if (tcb->rt_budget <= 0 || now >= tcb->rt_abs_deadline
+		|| tcb->rt_budget * tcb->rt_period > (tcb->rt_abs_deadline - now) * tcb->rt_runtime)
+		rt_new_job(tcb, now);
+}
+
+/* Insert tcb into a list ordered by key */
+static void rt_insert(rlnode* list, TCB* tcb, TimerDuration (*key)(TCB*))
+{
+	TimerDuration k = key(tcb);
+	rlnode* p = list->prev;
+	while (p != list && key(p->tcb) > k)
+		p = p->prev;
+	rl_splice(p, &tcb->sched_node);
+}
+
+static TimerDuration rt_key_deadline(TCB* tcb) { return tcb->rt_abs_deadline; }
+static TimerDuration rt_key_release(TCB* tcb) { return tcb->rt_release; }
+
+/*
+  Queue a real-time thread at its core, ready or throttled.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static void rt_push(run_queue* rq, TCB* tcb, TimerDuration now)
+{
+	if (tcb->rt_budget <= 0 && now >= tcb->rt_release)
+		rt_new_job(tcb, tcb->rt_release);
+
+	if (tcb->rt_budget > 0)
+		rt_insert(&rq->rt_queue, tcb, rt_key_deadline);
+	else {
+		rt_insert(&rq->rt_throttled, tcb, rt_key_release);
+		rq->rt_next_release = rq->rt_throttled.next->tcb->rt_release;
+	}
+}
+
+/*
+  Move the throttled threads whose release time has come to the ready 
+  queue, with a new job.
+
+  *** MUST BE CALLED WITH rq->lock HELD ***
+*/
+static void rt_unthrottle(run_queue* rq, TimerDuration now)
+{
+	if (now < rq->rt_next_release)
+		return;
+
+	while (!is_rlist_empty(&rq->rt_throttled) && rq->rt_throttled.next->tcb->rt_release <= now) {
+		TCB* tcb = rlist_pop_front(&rq->rt_throttled)->tcb;
+		rt_new_job(tcb, tcb->rt_release);
+		rt_insert(&rq->rt_queue, tcb, rt_key_deadline);
+	}
+
+	rq->rt_next_release = is_rlist_empty(&rq->rt_throttled) ? NO_TIMEOUT 
+		: rq->rt_throttled.next->tcb->rt_release;
+}
+
+static int sched_unpark(coremask_t mask);
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+int set_thread_realtime(const rt_attr* attr)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	TCB* tcb = CURTHREAD;
 
-	/* Set the owner */
-	tcb->owner_pcb = pcb;
+	if (attr != NULL && !(0 < attr->runtime && attr->runtime <= attr->deadline 
+		&& attr->deadline <= attr->period && attr->period <= RT_PERIOD_MAX))
+		return -1;
 
-	/* Initialize the other attributes */
-	tcb->type = NORMAL_THREAD;
-	tcb->state = INIT;
-	tcb->phase = CTX_CLEAN;
-	tcb->thread_func = func;
-	tcb->wakeup_time = NO_TIMEOUT;
-	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	int preempt = preempt_off;
+	spin_lock(&rt_spinlock);
+
+	/* Give back the bandwidth we have */
+	if (tcb->rt)
+		cctx[tcb->rt_core].rq.rt_bandwidth -= rt_bandwidth(tcb->rt_runtime, tcb->rt_period);
+
+	/* Find the allowed core with the most spare bandwidth */
+	int core = -1;
+	if (attr != NULL) {
+		unsigned long bw = rt_bandwidth(attr->runtime, attr->period);
+		for (uint c = 0; c < cpu_cores(); c++) {
+			unsigned long used = cctx[c].rq.rt_bandwidth;
+			if ((tcb->affinity & (1u << c)) && used + bw <= RT_BANDWIDTH_MAX
+				&& (core < 0 || used < cctx[core].rq.rt_bandwidth))
+				core = c;
+		}
+		if (core >= 0)
+			cctx[core].rq.rt_bandwidth += bw;
+	}
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
-	tcb->last_cause = SCHED_IDLE;
-	tcb->curr_cause = SCHED_IDLE;
+	int ret = 0;
+	if (attr != NULL && core < 0) {
+		/* Not admitted, keep what we had */
+		if (tcb->rt)
+			cctx[tcb->rt_core].rq.rt_bandwidth += rt_bandwidth(tcb->rt_runtime, tcb->rt_period);
+		ret = -1;
+	} 
+	else {
+		if (tcb->rt && attr == NULL)
+			rt_threads--;
+		if (!tcb->rt && attr != NULL)
+			rt_threads++;
+
+		spin_lock(&tcb->state_spinlock);
+		tcb->rt = (attr != NULL);
+		if (attr != NULL) {
+			tcb->rt_runtime = attr->runtime;
+			tcb->rt_deadline = attr->deadline;
+			tcb->rt_period = attr->period;
+			tcb->rt_core = core;
+			tcb->affinity = 1u << core;
+			sched_unpark(1u << core);
+			TimerDuration now = bios_clock();
+			rt_new_job(tcb, now);
+
+			/* The time slice so far is not charged to the first job */
+			tcb->rt_budget += now - tcb->slice_start;
+		}
+		spin_unlock(&tcb->state_spinlock);
+	}
 
-/***********************************************************************************************************************/
-  tcb->priority = PRIORITY_QUEUES-1; /* The first time a thread is executed, it is placed at the highest priority queue */
-/*********************************************************************************************************************/
+	spin_unlock(&rt_spinlock);
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	/* Let the scheduler place us according to the new class */
+	if (ret == 0)
+		yield(SCHED_USER);
 
-	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	if (preempt)
+		preempt_on;
+	return ret;
+}
 
-#ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
-#endif
+/*
+  Adaptive time-slices. A thread that uses up its time-slice gets twice 
+  as long the next time, and a thread that sleeps for I/O half as long. 
+  The time-slice stays between a quarter of the quantum and a limit that
+  grows with the depth of the thread below the top priority: the quantum,
+  doubled every SLICE_LEVELS levels, up to SLICE_MAX_SHIFT times. The 
+  priority range is split into SLICE_MAX_SHIFT+1 equal bands, so the limit
+  is the quantum in the top quarter, twice the quantum in the next one, 
+  and so on, up to 8 quanta in the bottom quarter. So the CPU-bound 
+  threads, which sink, switch less often, and the interactive threads, 
+  which stay on top, do not hold up the others for long. With boot option
+  fixed_quantum, or in fair-share mode, every time-slice is the quantum.
+ */
+#define SLICE_LEVELS (PRIORITY_QUEUES / (SLICE_MAX_SHIFT + 1))
+#define SLICE_MAX_SHIFT 3
+#define SLICE_MIN (sched_quantum / 4)
 
-	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+static TimerDuration slice_limit(TCB* tcb)
+{
+	int shift = (PRIORITY_QUEUES - 1 - tcb->priority) / SLICE_LEVELS;
+	return sched_quantum << (shift < SLICE_MAX_SHIFT ? shift : SLICE_MAX_SHIFT);
+}
 
-	return tcb;
+static void slice_clamp(TCB* tcb)
+{
+	TimerDuration limit = slice_limit(tcb);
+	if (tcb->its > limit)
+		tcb->its = limit;
+	if (tcb->its < SLICE_MIN)
+		tcb->its = SLICE_MIN;
+}
+
+/* Adapt the time-slice of a thread to the cause of its last yield */
+static void slice_adapt(TCB* tcb, enum SCHED_CAUSE cause)
+{
+	if (sched_fixed_quantum || tcb->type == IDLE_THREAD)
+		return;
+
+	if (cause == SCHED_QUANTUM)
+		tcb->its *= 2;
+	else if (cause == SCHED_IO)
+		tcb->its /= 2;
+	slice_clamp(tcb);
 }
 
 /*
-  This is called with sched_spinlock locked !
+  The length of the next timeslice of a thread that starts running at
+  time now: the budget of a real-time thread, or the quantum of a normal 
+  one. While there are real-time threads, it is cut short, so that the
+  core is there when a real-time thread may become ready.
  */
-void release_TCB(TCB* tcb)
+static TimerDuration sched_timeslice(TCB* tcb, TimerDuration now)
 {
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
+	TimerDuration slice = tcb->rt ? tcb->rt_budget : tcb->rts;
+	if (rt_threads == 0)
+		return slice;
 
-	free_thread(tcb, THREAD_SIZE);
+	TimerDuration event = sched_next_deadline();
+	if (CURCORE.rq.rt_next_release < event)
+		event = CURCORE.rq.rt_next_release;
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	if (event <= now)
+		return 1;
+	return (event - now < slice) ? event - now : slice;
 }
 
+/* Whether core c is running its idle thread, a hint read without locks */
+static inline int core_is_idle(uint c) { return cctx[c].current_thread == &cctx[c].idle_thread; }
+
 /*
- *
- * Scheduler
- *
+  Core parking.
+
+  When there is little work, the idle cores would still wake up for
+  every timeout, only to find nothing to run. Therefore, a core other
+  than core 0 that stays idle for park_delay parks itself: it halts until
+  it is unparked, without waking up for timeouts, and threads are not 
+  placed on it, stolen by it, or moved to it by the load balancer. 
+
+  A parked core is unparked when the threads queued on the unparked 
+  cores outnumber their idle cores by unpark_depth, or when a thread may
+  only run on parked cores, or gets real-time bandwidth on one. Core 0 never parks,
+  so that the timeouts are always served.
  */
+static coremask_t parked_cores = 0;
+static int sched_parking = 1;
+static TimerDuration park_delay = PARK_DELAY;
+static unsigned int unpark_depth = UNPARK_DEPTH;
+
+static inline coremask_t parked_mask() { return __atomic_load_n(&parked_cores, __ATOMIC_RELAXED); }
 
 /*
- *  Note: the scheduler routines are all in the non-preemptive domain.
+  Unpark a parked core in mask, and return it, or -1 if there is none. 
+  The core is marked in CURCORE.kicks, to be interrupted by 
+  sched_send_kicks().
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
  */
+static int sched_unpark(coremask_t mask)
+{
+	coremask_t parked;
+	while ((parked = parked_mask() & mask) != 0) {
+		uint c = __builtin_ctz(parked);
+		coremask_t bit = 1u << c;
+		if (__atomic_fetch_and(&parked_cores, ~bit, __ATOMIC_ACQ_REL) & bit) {
+			__atomic_add_fetch(&cctx[c].stats.unparks, 1, __ATOMIC_RELAXED);
+			if (c != cpu_core_id)
+				CURCORE.kicks |= bit;
+			return c;
+		}
+	}
+	return -1;
+}
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Restart an idle core to serve a timeout that became the earliest. This is
+  core 0, if it is idle, since it never parks; else some other idle core 
+  that is not parked; else core 0, which sees the timeout when it yields. 
+  The core is marked in CURCORE.kicks, to be interrupted by 
+  sched_send_kicks() once the timeout and state spinlocks are released.
+  Both the interrupt and the restart are sticky, so that a core that has
+  read its deadline but has not halted yet does not miss it.
+ */
+static void sched_restart_timer_core()
+{
+	uint target = 0;
+	if (!core_is_idle(0)) {
+		coremask_t parked = parked_mask();
+		for (uint c = 1; c < cpu_cores(); c++)
+			if (!(parked & (1u << c)) && core_is_idle(c)) {
+				target = c;
+				break;
+			}
+	}
+	CURCORE.kicks |= 1u << target;
+}
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+/*
+  The number of threads queued on the unparked cores, beyond those that
+  their idle cores are about to take. This is a hint, read without locks.
+ */
+static int sched_backlog()
+{
+	coremask_t parked = parked_mask();
+	int backlog = 0;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (!(parked & (1u << c)))
+			backlog += (int)cctx[c].rq.count - core_is_idle(c);
+	return backlog;
+}
 
-  Both of these structures are protected by @c sched_spinlock.
-*/
+/*
+  Park this core, unless it must stay active. Return whether it parked.
 
-/******************************************************************************************************************/
-rlnode SCHED[PRIORITY_QUEUES];                                        /* The scheduler queues */
-int yield_calls = 0;                                               /* Number of calls of yield() */
-/*****************************************************************************************************************/
+  *** MUST BE CALLED BY THE IDLE THREAD, WITH PREEMPTION OFF ***
+ */
+static int sched_park()
+{
+	if (cpu_core_id == 0 || !sched_parking || CURCORE.rq.count > 0 || CURCORE.rq.rt_bandwidth > 0)
+		return 0;
 
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+	__atomic_fetch_or(&parked_cores, 1u << cpu_core_id, __ATOMIC_ACQ_REL);
+	CURCORE.stats.parks++;
+	return 1;
+}
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+/*
+  Choose the run queue for a thread, among the unparked cores in its 
+  affinity. This is the last core of the thread, if it is idle, so that 
+  the thread finds its cache state there, or else the least loaded idle
+  core, or else the current core, or else the least loaded core. If all
+  the cores in its affinity are parked, one of them is unparked.
+ */
+static uint sched_choose_core(TCB* tcb)
+{
+	coremask_t mask = tcb->affinity & ~parked_mask();
+	if (mask == 0) {
+		int core = sched_unpark(tcb->affinity);
+		if (core >= 0)
+			return core;
+		mask = tcb->affinity;
+	}
+	if ((mask & (1u << tcb->last_core)) && core_is_idle(tcb->last_core))
+		return tcb->last_core;
+
+	uint core = cpu_core_id;
+	unsigned int best = UINT_MAX;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if ((mask & (1u << c)) && core_is_idle(c) && cctx[c].rq.count < best) {
+			core = c;
+			best = cctx[c].rq.count;
+		}
+	if (best != UINT_MAX || (mask & (1u << core)))
+		return core;
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
+	for (uint c = 0; c < cpu_cores(); c++)
+		if ((mask & (1u << c)) && cctx[c].rq.count < best) {
+			core = c;
+			best = cctx[c].rq.count;
+		}
+	assert(best != UINT_MAX);
+	return core;
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Add TCB to the end of a run queue, chosen by sched_choose_core(). Another
+  core is marked in CURCORE.kicks, to be interrupted by sched_send_kicks().
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD, OR BY A CORE THAT
+      HAS JUST REMOVED tcb FROM A RUN QUEUE ***
 */
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+static void sched_queue_add(TCB* tcb)
 {
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	if (tcb->rt) {
+		run_queue* rq = &cctx[tcb->rt_core].rq;
+		spin_lock(&rq->lock);
+		rt_push(rq, tcb, bios_clock());
+		spin_unlock(&rq->lock);
+		return;
+	}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+	uint core = sched_choose_core(tcb);
+	run_queue* rq = &cctx[core].rq;
+
+	spin_lock(&rq->lock);
+	rq_push(rq, tcb);
+	spin_unlock(&rq->lock);
+
+	/* The backlog is building, another core may steal from it */
+	if (parked_mask() != 0 && sched_backlog() >= (int)unpark_depth)
+		sched_unpark(tcb->affinity);
+
+	if (core != cpu_core_id) {
+		CURCORE.kicks |= 1u << core;
+		return;
 	}
+
+	/* If this is the idle thread (e.g., in an interrupt handler), it must 
+	   not halt with a thread in its queue */
+	if (CURTHREAD == &CURCORE.idle_thread)
+		cpu_core_restart(cpu_core_id);
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Interrupt the cores that sched_queue_add() queued threads for. An idle
+  core gets an inter-core interrupt, so that it runs the thread at once,
+  and a busy core is restarted in case it is about to halt. The cores in
+  CURCORE.preempts, where a real-time thread became ready, get an 
+  inter-core interrupt even if they are busy.
+
+  This must be called after the state spinlock of the queued thread is
+  released. Else, the other core may pick the thread and spin on its lock,
+  while the host deschedules this core inside the signal call.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_send_kicks()
 {
-/********************************************************************************************************************/
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);            /* Insert tcb at the end of the proper queue */
-/********************************************************************************************************************/
-
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	coremask_t kicks = CURCORE.kicks | CURCORE.preempts;
+	coremask_t preempts = CURCORE.preempts;
+	CURCORE.kicks = CURCORE.preempts = 0;
+
+	while (kicks) {
+		uint core = __builtin_ctz(kicks);
+		kicks &= kicks - 1;
+		if ((preempts & (1u << core)) || core_is_idle(core))
+			cpu_ici(core);
+		else
+			cpu_core_restart(core);
+	}
 }
 
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD, AND ALSO WITH
+	    timeout_spinlock HELD IF THE THREAD HAS A TIMEOUT ***
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timer wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timer wheel, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
+		timer_wheel_cancel(tcb);
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
 	/* Mark as ready */
 	tcb->state = READY;
+	if (sched_fair)
+		__atomic_add_fetch(&tcb->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
+
+	if (tcb->rt)
+		rt_wakeup(tcb, bios_clock());
 
 	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
+	if (tcb->phase == CTX_CLEAN) {
 		sched_queue_add(tcb);
+
+		/* A real-time thread preempts whatever runs on its core, once
+		   the locks are released */
+		if (tcb->rt)
+			CURCORE.preempts |= 1u << tcb->rt_core;
+	}
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Advance the timer wheel to time 'now', and wake up the threads
+  whose timeout has expired.
+*/
+static void sched_wakeup_expired_timeouts(TimerDuration now)
+{
+	TimerDuration curtick = now >> TIMER_TICK_SHIFT;
+
+	/* Avoid the lock, unless the wheel has work to do */
+	if (timer_wheel.next > curtick)
+		return;
+
+	spin_lock(&timeout_spinlock);
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+	timer_wheel_advance(curtick, &expired);
+
+	while (!is_rlist_empty(&expired)) {
+		TCB* tcb = expired.next->tcb;
+		spin_lock(&tcb->state_spinlock);
+		sched_make_ready(tcb);
+		spin_unlock(&tcb->state_spinlock);
+		TRACE(TRACE_TIMEOUT, tcb, 0, now);
+	}
+
+	spin_unlock(&timeout_spinlock);
+}
+
+/*
+  Steal the highest-priority thread that may run on this core, from the
+  run queue of some other core. The cores are probed round-robin, starting from the next one.
+  Return NULL if no other core has queued threads.
 */
-static void sched_wakeup_expired_timeouts()
+static TCB* sched_steal()
+{
+	uint ncores = cpu_cores();
+
+	for (uint i = 1; i < ncores; i++) {
+		run_queue* rq = &cctx[(cpu_core_id + i) % ncores].rq;
+
+		/* Peek without the lock first */
+		if (rq->count == 0)
+			continue;
+
+		spin_lock(&rq->lock);
+		TCB* tcb = rq_pop_for(rq, cpu_core_id, NO_TIMEOUT);
+		spin_unlock(&rq->lock);
+
+		if (tcb != NULL) {
+			/* Keep the lead of the thread over the virtual clock of its core */
+			if (sched_fair)
+				tcb->vruntime += CURCORE.rq.min_vruntime - rq->min_vruntime;
+			CURCORE.stats.steals++;
+			return tcb;
+		}
+	}
+	return NULL;
+}
+
+/*
+  Load balancing.
+
+  Threads are placed on cores when they wake up, and cores that run out
+  of threads steal from the others. But a core that keeps running a 
+  CPU-bound thread never runs out, and a halted core does not look for
+  work. So, threads queued behind a CPU-bound thread may wait there, while
+  other cores halt.
+
+  Therefore, once every BALANCE_PERIOD, the next core to take an ALARM
+  compares the loads of the cores, and moves READY threads from the most
+  loaded core to the least loaded one. The load of a core is an average
+  of the number of threads queued there, plus the share of the time the
+  core was busy, sampled at each balance and decayed by half each time.
+  Each balance fills the least loaded cores from the most loaded ones, 
+  towards an equal number of threads on each core.
+
+  To avoid moving threads back and forth, two cores are balanced only if
+  their current numbers of threads differ by at least 2, and their 
+  average loads by more than BALANCE_THRESHOLD. A migrated thread stays on its new
+  core for at least BALANCE_HOLD, except that idle cores may still steal it.
+ */
+
+#define LOAD_SCALE 1024
+#define BALANCE_THRESHOLD LOAD_SCALE
+#define BALANCE_HOLD (4 * BALANCE_PERIOD)
+
+static struct {
+	char running;				/* set by the core that balances */
+	volatile TimerDuration next;	/* the time of the next balance */
+	TimerDuration last;			/* the time of the last balance */
+	TimerDuration busy_time[MAX_CORES];	/* the busy time of each core at the last balance */
+	unsigned int load[MAX_CORES];	/* the average load of each core, times LOAD_SCALE */
+} balancer;
+
+static int sched_balancing = 1;
+
+/* Sample the loads of the cores, and return the current number of threads of each */
+static void balance_sample(TimerDuration now, unsigned int* nr)
+{
+	TimerDuration elapsed = now - balancer.last;
+	balancer.last = now;
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		TimerDuration busy = cctx[c].busy_time - balancer.busy_time[c];
+		balancer.busy_time[c] += busy;
+		if (busy > elapsed)
+			busy = elapsed;
+
+		unsigned int queued = cctx[c].rq.count;
+		unsigned int sample = queued * LOAD_SCALE + (elapsed ? busy * LOAD_SCALE / elapsed : 0);
+		balancer.load[c] = (balancer.load[c] + sample) / 2;
+		nr[c] = queued + !core_is_idle(c);
+	}
+}
+
+/*
+  Move up to n threads from core src to core dst, and return how many
+  were moved.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+ */
+static unsigned int balance_move(uint src, uint dst, unsigned int n, TimerDuration now)
+{
+	run_queue* from = &cctx[src].rq;
+	run_queue* to = &cctx[dst].rq;
+
+	rlnode moved;
+	rlnode_init(&moved, NULL);
+	unsigned int count = 0;
+
+	spin_lock(&from->lock);
+	TCB* tcb;
+	while (count < n && (tcb = rq_pop_for(from, dst, now - BALANCE_HOLD)) != NULL) {
+		rlist_push_back(&moved, &tcb->sched_node);
+		count++;
+	}
+	spin_unlock(&from->lock);
+
+	if (count == 0)
+		return 0;
+
+	spin_lock(&to->lock);
+	while (!is_rlist_empty(&moved)) {
+		tcb = rlist_pop_front(&moved)->tcb;
+		if (sched_fair)
+			tcb->vruntime += to->min_vruntime - from->min_vruntime;
+		tcb->migrated = now;
+		tcb->last_core = dst;
+		rq_push(to, tcb);
+	}
+	spin_unlock(&to->lock);
+
+	cctx[dst].stats.migrations += count;
+	if (dst != cpu_core_id)
+		CURCORE.kicks |= 1u << dst;
+	return count;
+}
+
+/*
+  Balance the cores, if it is time. This is called on ALARM, with 
+  preemption off.
+ */
+static void sched_balance()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	if (!sched_balancing || cpu_cores() == 1)
+		return;
+
+	TimerDuration now = bios_clock();
+	if (now < balancer.next || __atomic_test_and_set(&balancer.running, __ATOMIC_ACQUIRE))
+		return;
+
+	balancer.next = now + BALANCE_PERIOD;
+
+	unsigned int nr[MAX_CORES];
+	balance_sample(now, nr);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
+	/* Parked cores are left out, core 0 never parks */
+	coremask_t parked = parked_mask();
+	unsigned int total = 0, active = 0;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (!(parked & (1u << c))) {
+			total += nr[c];
+			active++;
+		}
+	unsigned int lo = total / active;
+	unsigned int hi = lo + (total % active != 0);
+
+	/* Fill the least loaded core from the most loaded one, up to the fair share */
+	for (uint i = 1; i < active; i++) {
+		uint busiest = 0, idlest = 0;
+		for (uint c = 1; c < cpu_cores(); c++) {
+			if (parked & (1u << c))
+				continue;
+			if (nr[c] > nr[busiest])
+				busiest = c;
+			if (nr[c] < nr[idlest])
+				idlest = c;
+		}
+
+		if (nr[busiest] < nr[idlest] + 2
+			|| balancer.load[busiest] <= balancer.load[idlest] + BALANCE_THRESHOLD)
 			break;
-		sched_make_ready(tcb);
+
+		unsigned int n = nr[busiest] - lo;
+		if (n > hi - nr[idlest])
+			n = hi - nr[idlest];
+		unsigned int moved = balance_move(busiest, idlest, n, now);
+		if (moved == 0)
+			break;
+		nr[busiest] -= moved;
+		nr[idlest] += moved;
 	}
+
+	__atomic_clear(&balancer.running, __ATOMIC_RELEASE);
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Select the next thread to run on this core. This is the real-time thread
+  with the earliest deadline, or else the head of the local run queue, or
+  else the current thread if it is still ready (and may run here), or else
+  a thread stolen from another core, or else the idle thread.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH current->state_spinlock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
-{
-/******************************************************************************************************************************************/
-  TCB* next_thread = NULL;
-  int occupied_queue = PRIORITY_QUEUES-1;
-
-	while(occupied_queue != 0)      /* The first thread existing at currently highest not empty queue will be executed next */
-	{
-			if(is_rlist_empty(&SCHED[occupied_queue]))
-				occupied_queue--;
-			else
-				break;                      /* Not empty queue found */																	
-	}
-   
-	rlnode* sel = rlist_pop_front(&SCHED[occupied_queue]);   /* Get the head of the SCHED[occupied_queue] */
-   
-  if(sel != NULL)
-		next_thread = sel->tcb; /* When the list is empty, this is NULL */
-/***********************************************************************************************************************************/
+static TCB* sched_queue_select(TCB* current, TimerDuration now)
+{
+	run_queue* rq = &CURCORE.rq;
+
+	spin_lock(&rq->lock);
+
+	/* 
+	   Move all ready threads one level up, once for every boost period
+	   that has passed. An empty run queue has no one to boost.
+	 */
+	if (!sched_fair && now >= rq->next_boost) {
+		TimerDuration periods = (now - rq->next_boost) / sched_boost_period + 1;
+		if (rq->count > 0) {
+			for (TimerDuration i = 0; i < periods && i < PRIORITY_QUEUES; i++)
+				rq_boost(rq);
+			CURCORE.stats.boosts += periods;
+			TRACE(TRACE_BOOST, NULL, periods < PRIORITY_QUEUES ? periods : PRIORITY_QUEUES, now);
+		}
+		rq->next_boost += periods * sched_boost_period;
+	}
+
+	/* Real-time threads first, earliest deadline first */
+	TCB* next_thread = NULL;
+	rt_unthrottle(rq, now);
+
+	int current_rt = current->rt && current->state == READY && current->rt_core == cpu_core_id;
+	if (current_rt && current->rt_budget <= 0 && now >= current->rt_release)
+		rt_new_job(current, current->rt_release);
+	current_rt = current_rt && current->rt_budget > 0;
+
+	if (!is_rlist_empty(&rq->rt_queue)
+		&& !(current_rt && current->rt_abs_deadline <= rq->rt_queue.next->tcb->rt_abs_deadline))
+		next_thread = rlist_pop_front(&rq->rt_queue)->tcb;
+	else if (current_rt)
+		next_thread = current;
+
+	/* 
+	   Threads whose affinity changed while they were queued here are
+	   set aside, and moved to other cores once the lock is released.
+	 */
+	coremask_t bit = 1u << cpu_core_id;
+	rlnode moved;
+	rlnode_init(&moved, NULL);
+
+	int current_ready = current->type != IDLE_THREAD && current->state == READY
+		&& !current->rt && (current->affinity & bit);
+
+	/* In fair-share mode, the current thread goes on while it is behind the rest */
+	if (next_thread == NULL && sched_fair && current_ready 
+		&& (is_rlist_empty(&rq->fair_queue) 
+			|| !vruntime_before(rq->fair_queue.next->tcb->vruntime, current->vruntime)))
+		next_thread = current;
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		while ((next_thread = rq_pop(rq)) != NULL && !(next_thread->affinity & bit))
+			rlist_push_back(&moved, &next_thread->sched_node);
+
+	if (sched_fair && next_thread != NULL && !next_thread->rt)
+		fair_update_min(rq, next_thread);
+
+	spin_unlock(&rq->lock);
+
+	while (!is_rlist_empty(&moved))
+		sched_queue_add(rlist_pop_front(&moved)->tcb);
+
+	if (next_thread == NULL && current_ready)
+		next_thread = current;
+
+	if (next_thread == NULL && !(parked_mask() & bit))
+		next_thread = sched_steal();
 
-	next_thread->its = QUANTUM;
+	if (next_thread == NULL)
+		next_thread = &CURCORE.idle_thread;
 
 	return next_thread;
 }
@@ -374,14 +1894,29 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	spin_lock(&tcb->state_spinlock);
+
+	/* 
+	   A thread sleeping with a timeout is also in the timer wheel, whose lock
+	   must be taken first. Only the thread itself can set a timeout, so
+	   the test is stable while we hold the state spinlock.
+	 */
+	int timed = (tcb->wakeup_time != NO_TIMEOUT);
+	if (timed) {
+		spin_unlock(&tcb->state_spinlock);
+		spin_lock(&timeout_spinlock);
+		spin_lock(&tcb->state_spinlock);
+	}
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
+		TRACE(TRACE_WAKEUP, tcb, 0, bios_clock());
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	spin_unlock(&tcb->state_spinlock);
+	if (timed)
+		spin_unlock(&timeout_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -390,6 +1925,136 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+void kick_cores()
+{
+	/* A peek without preemption off is enough; if this thread moves 
+	   to another core, its old core sends the kicks when it switches. */
+	if ((cctx[cpu_core_id].kicks | cctx[cpu_core_id].preempts) == 0)
+		return;
+
+	int oldpre = preempt_off;
+	sched_send_kicks();
+	if (oldpre)
+		preempt_on;
+}
+
+/*
+  Set the cores that a thread may run on.
+ */
+void set_thread_affinity(TCB* tcb, coremask_t mask)
+{
+	int preempt = preempt_off;
+
+	spin_lock(&tcb->state_spinlock);
+	tcb->affinity = mask;
+	spin_unlock(&tcb->state_spinlock);
+
+	/* Leave this core at once, if we may not run here */
+	if (tcb == CURTHREAD && !(mask & (1u << cpu_core_id)))
+		yield(SCHED_USER);
+
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  Priority inheritance.
+
+  A thread that waits for a lock lends its priority to the holder, so that
+  threads of middle priority cannot keep the holder, and thereby the waiter,
+  off the CPU. The holder saves its own priority in pi_saved, and records
+  the lock in pi_lock. It gets its priority back when it releases that
+  lock, or when it inherits through another lock, when it releases the
+  latter.
+
+  The holder is read from the owner field of the lock, and it may release
+  the lock and exit at any time. Therefore, the owner field is read under
+  pi_spinlock, which reap_threads() passes through before freeing threads.
+  A thread must not exit while it holds a lock.
+
+  The lock may also be released while the priority is raised. The holder 
+  clears the owner field before it checks pi_lock, and inherit_priority()
+  sets pi_lock before it checks the owner field again. With sequentially
+  consistent accesses, at least one of the two sees the other, and 
+  restores the priority.
+ */
+
+/*
+  Set the priority of tcb to p, moving it to the queue of level p if it 
+  is queued. A thread that is being moved between run queues, with rq 
+  NULL, is pushed by the mover at the new priority.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_set_priority(TCB* tcb, int p)
+{
+	run_queue* rq;
+	while ((rq = __atomic_load_n(&tcb->rq, __ATOMIC_ACQUIRE)) != NULL) {
+		spin_lock(&rq->lock);
+		if (tcb->rq == rq) {
+			rq_remove(rq, rq_queue_of(rq, tcb), &tcb->sched_node);
+			tcb->priority = p;
+			rq_push(rq, tcb);
+			spin_unlock(&rq->lock);
+			return;
+		}
+		spin_unlock(&rq->lock);
+	}
+	tcb->priority = p;
+}
+
+void inherit_priority(void** owner)
+{
+	if (sched_fair)
+		return;
+
+	int preempt = preempt_off;
+	TCB* self = CURTHREAD;
+
+	spin_lock(&pi_spinlock);
+	TCB* holder = __atomic_load_n(owner, __ATOMIC_SEQ_CST);
+	if (holder != NULL && holder != self && holder->type != IDLE_THREAD 
+		&& !holder->rt && !self->rt) {
+
+		spin_lock(&holder->state_spinlock);
+		if (holder->priority < self->priority) {
+			if (holder->pi_lock == NULL)
+				holder->pi_saved = holder->priority;
+			__atomic_store_n(&holder->pi_lock, owner, __ATOMIC_SEQ_CST);
+			sched_set_priority(holder, self->priority);
+
+			/* The holder released the lock meanwhile, and may have missed pi_lock */
+			if (__atomic_load_n(owner, __ATOMIC_SEQ_CST) != holder 
+				&& holder->pi_lock == owner) {
+				holder->pi_lock = NULL;
+				sched_set_priority(holder, holder->pi_saved);
+			}
+		}
+		spin_unlock(&holder->state_spinlock);
+	}
+	spin_unlock(&pi_spinlock);
+
+	if (preempt)
+		preempt_on;
+}
+
+void restore_priority(void** owner)
+{
+	TCB* tcb = cur_tcb;
+	if (tcb == NULL || __atomic_load_n(&tcb->pi_lock, __ATOMIC_SEQ_CST) != owner)
+		return;
+
+	/* The current thread is not queued. If another lock was recorded in
+	   pi_lock meanwhile, the priority lent through it is kept. */
+	int preempt = preempt_off;
+	spin_lock(&tcb->state_spinlock);
+	if (__atomic_compare_exchange_n(&tcb->pi_lock, &owner, NULL, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		tcb->priority = tcb->pi_saved;
+	spin_unlock(&tcb->state_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -401,22 +2066,36 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+
+	int timed = (state != EXITED && timeout != NO_TIMEOUT);
+	if (timed)
+		spin_lock(&timeout_spinlock);
+	spin_lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
+	if (sched_fair)
+		__atomic_sub_fetch(&tcb->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
 
 	/* register the timeout (if any) for the sleeping thread */
-	if (state != EXITED)
+	if (timed)
 		sched_register_timeout(tcb, timeout);
-
-	/* Release mx */
+	TRACE(TRACE_SLEEP, tcb, cause, bios_clock());
+
+	/* Release the scheduler spinlocks before calling yield() !!! */
+	spin_unlock(&tcb->state_spinlock);
+	if (timed)
+		spin_unlock(&timeout_spinlock);
+
+	/* 
+	   Release mx. A contended unlock wakes up another thread, which takes
+	   scheduler spinlocks, so this is done without holding any. The thread
+	   is already marked as sleeping, so a wakeup sent to it from now on is 
+	   not lost: it makes the thread ready, and yield() requeues it.
+	 */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -437,11 +2116,13 @@ void yield(enum SCHED_CAUSE cause)
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-/***************************************************************************************************************************************/
-  yield_calls++;
-/*************************************************************************************************************************************/
+	/* Wake up threads whose sleep timeout has expired */
+	CURCORE.stats.yields++;
+
+	TimerDuration now = bios_clock();
+	sched_wakeup_expired_timeouts(now);
 
-	Mutex_Lock(&sched_spinlock);
+	spin_lock(&current->state_spinlock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -449,22 +2130,22 @@ void yield(enum SCHED_CAUSE cause)
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
+	if (current->type != IDLE_THREAD) {
+		TimerDuration ran = now - current->slice_start;
+		__atomic_add_fetch(&current->owner_pcb->cpu_time, ran, __ATOMIC_RELAXED);
+		current->cpu_time += ran;
+		CURCORE.busy_time += ran;
+		if (current->rt)
+			current->rt_budget -= (long)ran;
+		else if (sched_fair)
+			current->vruntime = fair_charge(current, ran);
+	}
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
-
-	/* Get next */
-	TCB* next = sched_queue_select(current);
-	assert(next != NULL);
-
-	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
-
 /***************************************************************************************************************************************************/
+	/* Adjust the priority under the state spinlock, which inherit_priority() also takes,
+	   and before the thread is queued, so that it is queued at its new priority */
 	switch(cause)
 	{		
 		case SCHED_IO:
@@ -485,33 +2166,26 @@ void yield(enum SCHED_CAUSE cause)
 		default:
 			break;
 	}
+/*****************************************************************************************************************************************/
 
-	auto void boost() 											/* Move all threads of each queue to the immediately higher one */
-	{
-		int i = PRIORITY_QUEUES-2; 						/* Start from the second highest priority queue */
+	/* Get next */
+	TCB* next = sched_queue_select(current, now);
+	assert(next != NULL);
 
-		while(i >= 0)
-		{
-			while(!is_rlist_empty(&SCHED[i]))
-			{
-				rlnode* current = rlist_pop_front(&SCHED[i]);
-				current->tcb->priority++;
-				rlist_push_front(&SCHED[i+1], current);
-			}
-			i--;		
-		}
-	}
+	/* Save the current TCB for the gain phase */
+	CURCORE.previous_thread = current;
 
-	if(yield_calls == CALLS_FOR_BOOST)
-	{
-		boost();
-		yield_calls = 0;
-	}
-/*****************************************************************************************************************************************/
+	spin_unlock(&current->state_spinlock);
+
+	slice_adapt(current, cause);
 
 	/* Switch contexts */
 	if (current != next) {
+		TRACE(TRACE_SWITCH_OUT, current, cause, now);
+		TRACE(TRACE_SWITCH_IN, next, 0, now);
 		CURTHREAD = next;
+		cur_tcb = next;
+		CURCORE.stats.switches++;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -535,42 +2209,56 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	spin_lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
-	current->rts = current->its;
+	current->last_core = cpu_core_id;
+
+	/* A thread back from I/O finishes its time-slice, unless little is left */
+	if (!sched_fixed_quantum && current->type != IDLE_THREAD)
+		slice_clamp(current);
+	if (sched_fixed_quantum || current->curr_cause != SCHED_IO || current->rts < SLICE_MIN)
+		current->rts = current->its;
+	spin_unlock(&current->state_spinlock);
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		spin_lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
-		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
-			break;
-		case EXITED:
+		Thread_state prev_state = prev->state;
+		if (prev_state == READY && prev->type != IDLE_THREAD)
+			sched_queue_add(prev);
+		spin_unlock(&prev->state_spinlock);
+
+		/* prev->state should not be INIT or RUNNING ! */
+		assert(prev_state == READY || prev_state == STOPPED || prev_state == EXITED);
+
+		/* Once EXITED, no other core may touch prev */
+		if (prev_state == EXITED)
 			release_TCB(prev);
-			break;
-		case STOPPED:
-			break;
-		default:
-			assert(0); /* prev->state should not be INIT or RUNNING ! */
-		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Threads queued for other cores during the switch */
+	sched_send_kicks();
+
+	if (thread_cache[cpu_core_id].reaping >= REAP_BATCH)
+		reap_threads();
+
+	/* Start charging the time slice before we can be preempted */
+	TimerDuration now = bios_clock();
+	current->slice_start = now;
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set an alarm for the timeslice. The idle thread does not need one, it halts */
+	if (current->type != IDLE_THREAD)
+		bios_set_timer(sched_timeslice(current, now));
 }
 
 static void idle_thread()
@@ -578,9 +2266,39 @@ static void idle_thread()
 	/* When we first start the idle thread */
 	yield(SCHED_IDLE);
 
+	/* The core has been idle since idle_since, if busy_time has not changed */
+	coremask_t bit = 1u << cpu_core_id;
+	TimerDuration idle_since = bios_clock();
+	TimerDuration busy_time = CURCORE.busy_time;
+	int parked = 0;
+
 	/* We come here whenever we cannot find a ready thread for our core */
-	while (active_threads > 0) {
-		cpu_core_halt();
+	while (__atomic_load_n(&active_threads, __ATOMIC_ACQUIRE) > 0) {
+		int preempt = preempt_off;
+		reap_threads();
+
+		TimerDuration deadline = sched_next_deadline();
+		if (CURCORE.rq.rt_next_release < deadline)
+			deadline = CURCORE.rq.rt_next_release;
+
+		TimerDuration now = bios_clock();
+		if (CURCORE.busy_time != busy_time || (parked && !(parked_mask() & bit))) {
+			busy_time = CURCORE.busy_time;
+			idle_since = now;
+		}
+
+		/* Park, or halt no longer than until it is time to park */
+		parked = (parked_mask() & bit) != 0;
+		if (!parked && now >= idle_since + park_delay)
+			parked = sched_park();
+		if (parked)
+			deadline = CPU_NO_DEADLINE;
+		else if (cpu_core_id != 0 && sched_parking && idle_since + park_delay < deadline)
+			deadline = idle_since + park_delay;
+
+		if (preempt)
+			preempt_on;
+		cpu_core_halt_until(deadline);
 		yield(SCHED_IDLE);
 	}
 
@@ -592,19 +2310,81 @@ static void idle_thread()
 /*
   Initialize the scheduler queues
  */
-void initialize_scheduler()
+void initialize_scheduler(const boot_options* options)
 {
-/*****************************************************************************************************************************/
-	int i = 0;
+	sched_quantum = options->quantum;
+	sched_boost_period = options->boost_period;
+	thread_cache_size = options->thread_cache;
+	sched_fair = options->fair_share;
+	sched_tas_spinlocks = options->tas_spinlocks;
+	sched_fixed_quantum = options->fixed_quantum || options->fair_share;
+	sched_balancing = !options->no_balancing;
+	sched_parking = !options->no_parking;
+	park_delay = options->park_delay;
+	unpark_depth = options->unpark_depth;
+	parked_cores = 0;
+
+	if (options->trace_file != NULL) {
+		for (uint c = 0; c < cpu_cores(); c++)
+			trace_ring[c] = (struct trace_ring){ 0, xmalloc(TRACE_RING_SIZE * sizeof(trace_event)) };
+		sched_tracing = 1;
+	}
+
+	TimerDuration now = bios_clock();
+
+	balancer.running = 0;
+	balancer.next = now + BALANCE_PERIOD;
+	balancer.last = now;
+
+	for (int c = 0; c < MAX_CORES; c++) {
+		cctx[c].stats = (sched_stats){ 0 };
+		cctx[c].busy_time = 0;
+		cctx[c].kicks = cctx[c].preempts = 0;
+		balancer.busy_time[c] = 0;
+		balancer.load[c] = 0;
+
+		run_queue* rq = &cctx[c].rq;
+		rq->lock = SPINLOCK_INIT;
+		rq->count = 0;
+		rq->next_boost = now + sched_boost_period;
+		rq->base = 0;
+		rlnode_init(&rq->rt_queue, NULL);
+		rlnode_init(&rq->rt_throttled, NULL);
+		rq->rt_next_release = NO_TIMEOUT;
+		rq->rt_bandwidth = 0;
+		rlnode_init(&rq->fair_queue, NULL);
+		rq->min_vruntime = 0;
+		rq->summary = 0;
+		for (int i = 0; i < RUN_QUEUE_MAP_WORDS; i++)
+			rq->map[i] = 0;
+		for (int i = 0; i < PRIORITY_QUEUES; i++)
+			rlnode_init(&rq->queue[i], NULL);
+	}
 
-	while(i <= PRIORITY_QUEUES-1)
-	{
-			rlnode_init(&SCHED[i], NULL);
-			i++;
+	for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		for (int s = 0; s < TIMER_WHEEL_SLOTS; s++)
+			rlnode_init(&timer_wheel.slot[l][s], NULL);
+		timer_wheel.map[l] = 0;
 	}
-/*********************************************************************************************************************************/
+	timer_wheel.now = now >> TIMER_TICK_SHIFT;
+	timer_wheel.count = 0;
+	timer_wheel.next = NO_TIMEOUT;
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	rt_threads = 0;
+}
+
+void get_sched_stats(sched_stats* total)
+{
+	*total = (sched_stats){ 0 };
+	for (uint c = 0; c < MAX_CORES; c++) {
+		total->yields += cctx[c].stats.yields;
+		total->switches += cctx[c].stats.switches;
+		total->steals += cctx[c].stats.steals;
+		total->migrations += cctx[c].stats.migrations;
+		total->parks += cctx[c].stats.parks;
+		total->unparks += cctx[c].stats.unparks;
+		total->boosts += cctx[c].stats.boosts;
+	}
 }
 
 void run_scheduler()
@@ -615,16 +2395,19 @@ void run_scheduler()
 	curcore->id = cpu_core_id;
 
 	curcore->current_thread = &curcore->idle_thread;
+	cur_tcb = &curcore->idle_thread;
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.state_spinlock = SPINLOCK_INIT;
+	curcore->idle_thread.pi_lock = NULL;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
-	curcore->idle_thread.its = QUANTUM;
-	curcore->idle_thread.rts = QUANTUM;
+	curcore->idle_thread.its = sched_quantum;
+	curcore->idle_thread.rts = sched_quantum;
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
@@ -639,6 +2422,9 @@ void run_scheduler()
 
 	/* Finished scheduling */
 	assert(CURTHREAD == &CURCORE.idle_thread);
+	preempt_off;
+	reap_threads();
+	thread_cache_drain();
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
 }
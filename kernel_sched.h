@@ -24,6 +24,54 @@
 #include "tinyos.h"
 #include "util.h"
 
+
+/*****************************
+ *
+ *  Spinlocks
+ *
+ *****************************/
+
+/** @brief A waiter of a spinlock.
+
+  Each waiter spins on a node of its own, in a cache line of its own.
+  Each core has a few nodes, enough for the spinlocks it may hold at once.
+ */
+typedef struct spin_node {
+	struct spin_node* next; /**< @brief The next waiter in the queue */
+	int locked; /**< @brief Cleared when the lock is passed to this waiter */
+} __attribute__((aligned(64))) spin_node;
+
+/** @brief The number of spinlocks a core may hold at once */
+#define SPIN_NODES 8
+
+/** @brief A spinlock for the internal locks of the scheduler.
+
+  This is a queue (MCS) lock: the waiters form a queue, and each one 
+  spins on its own node until its predecessor hands the lock over. Thus,
+  the waiters do not hammer a shared cache line, and get the lock in FIFO
+  order. 
+
+  Spinlocks must be locked and unlocked with preemption off, on the same
+  core. They are only for the non-preemptive domain; elsewhere, use 
+  @c Mutex.
+
+  @see spin_lock
+  @see SPINLOCK_INIT
+ */
+typedef struct {
+	spin_node* tail; /**< @brief The last waiter, or the holder, or NULL if free */
+	spin_node* holder; /**< @brief The node of the holder */
+} Spinlock;
+
+/** @brief Initializer for spinlocks */
+#define SPINLOCK_INIT ((Spinlock){ NULL, NULL })
+
+/** @brief Lock a spinlock. This must be called with preemption off. */
+void spin_lock(Spinlock* lock);
+
+/** @brief Unlock a spinlock, on the core that locked it. */
+void spin_unlock(Spinlock* lock);
+
 /*****************************
  *
  *  The Thread Control Block
@@ -84,11 +132,12 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock slept on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A more urgent thread became ready */
 };
 
 /**
@@ -102,6 +151,7 @@ typedef struct thread_control_block {
 	PCB* owner_pcb; /**< @brief This is null for a free TCB */
 
 	cpu_context_t context; /**< @brief The thread context */
+	size_t stack_size; /**< @brief The size of the thread stack, right below the TCB */
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
@@ -116,12 +166,35 @@ typedef struct thread_control_block {
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
-	TimerDuration its; /**< @brief Initial time-slice for this thread */
+	TimerDuration its; /**< @brief Initial time-slice for this thread, adapted as it runs */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
+	TimerDuration slice_start; /**< @brief When the current time-slice started */
+	TimerDuration vruntime; /**< @brief The virtual runtime, in fair-share mode */
 
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	Spinlock state_spinlock; /**< @brief Protects @c state and @c phase */
+	coremask_t affinity; /**< @brief The cores this thread may run on */
+	uint last_core; /**< @brief The core this thread last ran on */
+	TimerDuration migrated; /**< @brief When the load balancer last moved this thread */
+	TimerDuration cpu_time; /**< @brief The CPU time used by this thread */
+	struct run_queue* rq; /**< @brief The run queue holding this thread, while it is queued by priority */
+
+	/* Priority inheritance, see inherit_priority() */
+	int pi_saved; /**< @brief The own priority of the thread, while it runs with an inherited one */
+	void** pi_lock; /**< @brief The owner field of the lock the priority was inherited through, or NULL */
+
+	/* Real-time scheduling, see set_thread_realtime() */
+	int rt; /**< @brief Non-zero for a real-time thread */
+	TimerDuration rt_runtime; /**< @brief The budget of each job */
+	TimerDuration rt_deadline; /**< @brief The relative deadline of each job */
+	TimerDuration rt_period; /**< @brief The minimum interval between jobs */
+	TimerDuration rt_abs_deadline; /**< @brief The deadline of the current job */
+	TimerDuration rt_release; /**< @brief The earliest start of the next job */
+	long rt_budget; /**< @brief The remaining budget of the current job */
+	uint rt_core; /**< @brief The core of a real-time thread */
+
 
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
@@ -142,12 +215,84 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Minimum thread stack size.
+
+  Smaller stacks are enlarged to this size. The stack must have room for
+  the interrupt handlers, which run on the stack of the current thread.
+ */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief Maximum thread stack size. */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/**
+  @brief Number of priority queues.
+
+  Thread priorities range from 0 (lowest) to @c PRIORITY_QUEUES-1 (highest).
+  New threads start at the highest priority.
+  */
+#define PRIORITY_QUEUES 2000
+
+/** @brief Number of 64-bit words in the occupancy bitmap of a run queue. */
+#define RUN_QUEUE_MAP_WORDS ((PRIORITY_QUEUES + 63) / 64)
+
+/** @brief A per-core run queue.
+
+  Each core keeps the @c READY threads that it will run next in its own 
+  multilevel queue, one list per priority level. The occupancy bitmap
+  allows the highest non-empty level to be found in constant time.
+  Real-time threads are kept apart, and run before all others.
+
+  In fair-share mode, the multilevel queue is not used. Instead, threads
+  are kept in @c fair_queue, in order of virtual runtime.
+
+  Priority level @c l is kept in @c queue[(l+base) % PRIORITY_QUEUES]. 
+  A priority boost decrements @c base, which moves every queue one level
+  up in constant time.
+
+  All fields are protected by @c lock, except for @c count which is also
+  read without the lock, as a hint, by cores looking for work to steal.
+ */
+typedef struct run_queue {
+	Spinlock lock; /**< @brief Spinlock protecting the run queue */
+	volatile unsigned int count; /**< @brief Number of queued threads */
+	TimerDuration next_boost; /**< @brief The time of the next priority boost */
+	int base; /**< @brief The queue of priority level 0 */
+
+	rlnode rt_queue; /**< @brief Ready real-time threads, by deadline */
+	rlnode rt_throttled; /**< @brief Real-time threads out of budget, by release time */
+	volatile TimerDuration rt_next_release; /**< @brief The release time at the head of @c rt_throttled */
+	unsigned long rt_bandwidth; /**< @brief The bandwidth of the real-time threads of the core, in ppm */
+
+	rlnode fair_queue; /**< @brief Threads by virtual runtime, in fair-share mode */
+	TimerDuration min_vruntime; /**< @brief The virtual clock of the core, in fair-share mode */
+
+	uint64_t summary; /**< @brief Bit @c w is set iff @c map[w] is non-zero */
+	uint64_t map[RUN_QUEUE_MAP_WORDS]; /**< @brief Bit @c q is set iff @c queue[q] is non-empty */
+	rlnode queue[PRIORITY_QUEUES]; /**< @brief The queues, one per priority level, rotated by @c base */
+} run_queue;
+
+/** @brief Per-core scheduler statistics.
+
+  Each core only updates its own counters, without synchronization.
+  The totals for the system are computed by @ref get_sched_stats.
+ */
+typedef struct sched_stats {
+	unsigned long yields; /**< @brief Calls to yield() */
+	unsigned long switches; /**< @brief Context switches */
+	unsigned long steals; /**< @brief Threads stolen from other cores */
+	unsigned long migrations; /**< @brief Threads moved here by the load balancer */
+	unsigned long parks; /**< @brief Times this core was parked */
+	unsigned long unparks; /**< @brief Times this core was unparked */
+	unsigned long boosts; /**< @brief Priority boosts of the run queue */
+} sched_stats;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
@@ -159,6 +304,15 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	run_queue rq; /**< @brief The run queue of this core */
+	sched_stats stats; /**< @brief The scheduler statistics of this core */
+	coremask_t kicks; /**< @brief Cores to interrupt, once the thread locks are released */
+	coremask_t preempts; /**< @brief Cores to preempt, even if busy, once the thread locks are released */
+	TimerDuration busy_time; /**< @brief The time this core ran threads other than its idle thread */
+
+	spin_node spin_nodes[SPIN_NODES]; /**< @brief The nodes of this core for waiting on spinlocks */
+	unsigned int spin_used; /**< @brief A bitmap of the nodes in use */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -171,8 +325,10 @@ extern CCB cctx[MAX_CORES];
   This function returns the TCB of the calling thread. Via this function,
   a system call can identify the process executing it, and all other information.
 
-  For performance reasons, it is advised to call this function
-  only once in each system call.
+  The current thread is kept in a thread-local variable of the core, and
+  is read with a single instruction. Therefore, this call needs not turn
+  preemption off; if the caller is preempted and moves to another core, 
+  the value it has read is still its own TCB.
 
   @returns a pointer to the TCB of the caller.
 */
@@ -204,9 +360,11 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread's stack. It is rounded up to a
+                multiple of the page size, and to at least @c THREAD_STACK_MIN.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -220,6 +378,20 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Interrupt the cores that threads were woken up for.
+
+  A thread woken up for another core runs there after an inter-core 
+  interrupt. @c wakeup() leaves these interrupts pending, because its 
+  caller usually holds some locks that the woken thread will need. On 
+  a host with fewer processors than cores, the woken thread would spin
+  on these locks, while the waker waits for a host processor.
+
+  The pending interrupts are sent when the current core switches threads,
+  or by calling this function once the locks are released.
+*/
+void kick_cores();
+
 /** 
   @brief Block the current thread.
 
@@ -252,6 +424,69 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief Set the cores that a thread may run on.
+
+  A queued thread is moved to one of these cores the next time it is 
+  selected to run, and a running thread the next time it yields. If
+  @c tcb is the current thread and it may not run on the current core,
+  this call yields at once. 
+
+  @param tcb the thread
+  @param mask the cores that @c tcb may run on, which must include
+    at least one existing core
+ */
+void set_thread_affinity(TCB* tcb, coremask_t mask);
+
+/**
+  @brief Lend the priority of the current thread to the holder of a lock.
+
+  The current thread is about to wait for a lock, whose holder is stored
+  in @c *owner. If the holder has a lower priority, it is raised to the 
+  priority of the current thread, and the holder is moved up in its run 
+  queue. The holder keeps the inherited priority until it releases the 
+  lock and calls @c restore_priority().
+
+  Real-time threads neither lend nor inherit priorities, and in fair-share 
+  mode, where priorities are not used, this call does nothing.
+
+  @param owner the owner field of the lock, read under a scheduler lock
+  @see restore_priority
+ */
+void inherit_priority(void** owner);
+
+/**
+  @brief Give the current thread back its own priority.
+
+  This must be called after the current thread has released a lock, and
+  cleared the owner field of the lock. If the current thread inherited
+  its priority through this lock, its own priority is restored.
+
+  @param owner the owner field of the released lock
+  @see inherit_priority
+ */
+void restore_priority(void** owner);
+
+/**
+  @brief Make the current thread a real-time thread, or a normal one.
+
+  A real-time thread runs a sequence of jobs. Each job may run for up to
+  @c runtime usec within @c deadline usec from its start, and jobs start 
+  at least @c period usec apart. Real-time threads run before all other
+  threads, earliest deadline first, on a core chosen at admission. A thread
+  that exhausts the budget of its job is throttled until its next period.
+
+  Admission control keeps the bandwidth (runtime/period) of the real-time 
+  threads of each core below @c RT_BANDWIDTH_MAX, so that other threads 
+  always get some of the core. The core is chosen among the cores in
+  the affinity of the thread, and the affinity is then set to that core.
+
+  @param attr the parameters, or @c NULL to make the thread normal again
+  @returns 0 on success, or -1 if the parameters are invalid or the thread
+    cannot be admitted
+ */
+int set_thread_realtime(const rt_attr* attr);
+
 /**
   @brief Give up the CPU.
 
@@ -274,8 +509,48 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param options the boot options, where all fields have been set
+ */
+void initialize_scheduler(const boot_options* options);
+
+/**
+  @brief Get the scheduler statistics of the system.
+
+  The per-core statistics are summed into @c total. This can be called
+  while the scheduler is running, or after it has stopped, in which 
+  case it returns the statistics of the last boot.
+
+  @param total the statistics to fill in
+ */
+void get_sched_stats(sched_stats* total);
+
+/**
+  @brief Turn the recording of scheduler events on or off.
+
+  The scheduler can record the context switches, wakeups, sleeps, expired
+  timeouts and priority boosts of each core, if the kernel was booted with
+  a trace file (see @ref boot_options). Recording starts on at boot, and
+  costs a few tens of nanoseconds per event.
+
+  @param on non-zero to record events, zero to stop
+  @returns the previous setting, or -1 if the kernel has no trace file
+ */
+int sched_trace(int on);
+
+/**
+  @brief Write the recorded scheduler events to a file.
+
+  This is called after the scheduler has stopped. The events are written 
+  in the Chrome trace-event JSON format, which can be loaded in Perfetto 
+  or chrome://tracing. Each core is shown as a thread, with a slice for 
+  each time-slice that it ran, and instant events for the rest. The
+  recording buffers are then released.
+
+  @param filename the file to write
+  @returns 0 on success, -1 on error or if nothing was recorded
  */
-void initialize_scheduler(void);
+int sched_trace_dump(const char* filename);
 
 /**
   @brief Quantum (in microseconds) 
@@ -284,6 +559,59 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief Boost period (in microseconds)
+
+  This is the default interval between two priority boosts of a
+  run queue, in microseconds.
+  */
+#define BOOST_PERIOD (100000L)
+
+/**
+  @brief Load balancing period (in microseconds)
+
+  The interval between two runs of the load balancer, which moves 
+  ready threads from the most loaded core to the least loaded one.
+  */
+#define BALANCE_PERIOD (20000L)
+
+/**
+  @brief Core parking delay (in microseconds)
+
+  How long a core must stay idle before it parks. A parked core halts
+  until it is unparked, and does not wake up for timeouts.
+  */
+#define PARK_DELAY (100000L)
+
+/**
+  @brief Unparking depth
+
+  A parked core is unparked when the threads queued on the unparked
+  cores outnumber their idle cores by this many.
+  */
+#define UNPARK_DEPTH 2
+
+/**
+  @brief Real-time bandwidth limit (in ppm)
+
+  The maximum share of each core given to real-time threads, in parts
+  per million.
+  */
+#define RT_BANDWIDTH_MAX 950000
+
+/**
+  @brief Real-time period limit (in microseconds)
+  */
+#define RT_PERIOD_MAX 10000000
+
+/**
+  @brief Thread cache size
+
+  This is the default number of free thread blocks (a TCB together with
+  its stack) that each core keeps for reuse.
+  */
+#define THREAD_CACHE_SIZE 64
+
 /** @} */
 
 #endif
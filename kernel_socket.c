@@ -9,11 +9,14 @@
 #include "kernel_socket.h"
 
 
+/* Reading and writing a peer socket is done by its pipes, which lock themselves.
+   The pipes are referenced while in use, as ShutDown and Close may race. */
 static file_ops socket_functions = {
   .Open = socket_open,
   .Read = socket_read,
   .Write = socket_write,
-  .Close = socket_close
+  .Close = socket_close,
+  .unlocked = 1
 };
 
 Fid_t sys_Socket(port_t port)
@@ -33,6 +36,7 @@ Fid_t sys_Socket(port_t port)
   fcb[0]->streamfunc = &socket_functions;
 
   scb->refcount = 0;
+  scb->lock = MUTEX_INIT;
 	scb->fcb = fcb[0];
 
   scb->type = SOCKET_UNBOUND;
@@ -46,6 +50,44 @@ void* socket_open(uint minor)
   return NULL; /* Open is "implemented" by the Socket function */      
 }
 
+/*
+  Return the pipe in *slot of a peer socket, with a reference taken, or 
+  NULL if the socket is not a peer or that end is shut down.
+ */
+static pipe_cb* socket_pipe_ref(SCB* scb, pipe_cb** slot)
+{
+	Mutex_Lock(&scb->lock);
+	pipe_cb* pipe = (scb->type == SOCKET_PEER) ? *slot : NULL;
+	if(pipe != NULL)
+		pipe_incref(pipe);
+	Mutex_Unlock(&scb->lock);
+	return pipe;
+}
+
+/* Detach the pipe in *slot of a peer socket, and return it to be closed, or NULL */
+static pipe_cb* socket_pipe_detach(SCB* scb, pipe_cb** slot)
+{
+	Mutex_Lock(&scb->lock);
+	pipe_cb* pipe = *slot;
+	*slot = NULL;
+	Mutex_Unlock(&scb->lock);
+	return pipe;
+}
+
+static void socket_shutdown_read(SCB* scb)
+{
+	pipe_cb* pipe = socket_pipe_detach(scb, &scb->peer_s.read_pipe);
+	if(pipe != NULL)
+		pipe_reader_close(pipe);
+}
+
+static void socket_shutdown_write(SCB* scb)
+{
+	pipe_cb* pipe = socket_pipe_detach(scb, &scb->peer_s.write_pipe);
+	if(pipe != NULL)
+		pipe_writer_close(pipe);
+}
+
 int socket_read(void* this, char *buf, unsigned int size)
 {
 	SCB* scb = (SCB*)this;
@@ -53,10 +95,13 @@ int socket_read(void* this, char *buf, unsigned int size)
 	if(scb == NULL)
 		return -1;
 
-	if(scb->peer_s.read_pipe != NULL && scb->type == SOCKET_PEER){
-		return pipe_read(scb->peer_s.read_pipe, buf, size); 
-	}else
+	pipe_cb* pipe = socket_pipe_ref(scb, &scb->peer_s.read_pipe);
+	if(pipe == NULL)
 		return -1;
+
+	int retcode = pipe_read(pipe, buf, size);
+	pipe_decref(pipe);
+	return retcode;
 }
 
 int socket_write(void* this, const char *buf, unsigned int size)
@@ -66,11 +111,13 @@ int socket_write(void* this, const char *buf, unsigned int size)
 	if(scb == NULL)
 		return -1;
 
-	if(scb->peer_s.write_pipe != NULL && scb->type == SOCKET_PEER){
-		return pipe_write(scb->peer_s.write_pipe, buf, size); 
-	}
-	else
+	pipe_cb* pipe = socket_pipe_ref(scb, &scb->peer_s.write_pipe);
+	if(pipe == NULL)
 		return -1;
+
+	int retcode = pipe_write(pipe, buf, size);
+	pipe_decref(pipe);
+	return retcode;
 }
 
 int socket_close(void* this)
@@ -81,8 +128,8 @@ int socket_close(void* this)
 		return -1;
 
 	if(scb->type == SOCKET_PEER){
-		pipe_reader_close(scb->peer_s.read_pipe);
-		pipe_writer_close(scb->peer_s.write_pipe);
+		socket_shutdown_read(scb);
+		socket_shutdown_write(scb);
 	}
 	else if(scb->type == SOCKET_LISTENER){
 		PORT_MAP[scb->port] = NULL;
@@ -129,22 +176,25 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
 	FCB* fcb = get_fcb(sock);
+	if(fcb == NULL || fcb->streamfunc != &socket_functions)
+		return -1;
 	SCB* scb = fcb->streamobj;
 
 	if(scb == NULL || scb->type != SOCKET_PEER)
 		return -1;
 
+	/* A Read or Write in progress keeps its pipe, and returns when its end is closed */
 	switch(how)
 	{
 		case SHUTDOWN_READ:
-		  pipe_reader_close(scb->peer_s.read_pipe);
+			socket_shutdown_read(scb);
 			break;
 		case SHUTDOWN_WRITE:
-			pipe_writer_close(scb->peer_s.write_pipe);
+			socket_shutdown_write(scb);
 			break;
 		case SHUTDOWN_BOTH:
-			pipe_reader_close(scb->peer_s.read_pipe);
-			pipe_writer_close(scb->peer_s.write_pipe);
+			socket_shutdown_read(scb);
+			socket_shutdown_write(scb);
 			break;
 		default:
 			return -1;
@@ -38,6 +38,7 @@ typedef struct peer_socket {
 typedef struct socket_control_block {
 
 	uint refcount;
+	Mutex lock;     /* Protects the pipes of a peer socket, see socket_pipe_ref() */
 	FCB* fcb;
 	socket_type type;
 	port_t port;
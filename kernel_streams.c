@@ -10,6 +10,7 @@
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+static Mutex FCB_freelist_lock = MUTEX_INIT;  /* The FCB table has its own lock */
 
 
 void initialize_files()
@@ -26,32 +27,34 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(&FCB_freelist_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
   }
-  else
-    return NULL;
+  Mutex_Unlock(&FCB_freelist_lock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&FCB_freelist_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&FCB_freelist_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -89,10 +92,12 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	return 0;
     }
     /* Found all */
+    Mutex_Lock(&cur->FIDT_lock);
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
+    Mutex_Unlock(&cur->FIDT_lock);
     return 1;
 }
 
@@ -101,11 +106,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->FIDT_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->FIDT_lock);
 }
 
 
@@ -128,6 +135,41 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+/*
+  Read and Write are called without the kernel lock. They look up the 
+  FCB and take a reference under the FIDT lock of the process, so that
+  a concurrent Close or Dup2 cannot release it under their feet.
+ */
+static FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->FIDT_lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(&cur->FIDT_lock);
+  return fcb;
+}
+
+/*
+  Drop a reference taken by get_fcb_ref(). The stream is closed with the
+  kernel lock held, if this was the last reference.
+ */
+static void put_fcb_ref(FCB* fcb)
+{
+  uint rc = __atomic_load_n(&fcb->refcount, __ATOMIC_RELAXED);
+  while(rc > 1)
+    if(__atomic_compare_exchange_n(&fcb->refcount, &rc, rc-1, 0, 
+          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return;
+
+  kernel_lock();
+  FCB_decref(fcb);
+  kernel_unlock();
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,25 +177,27 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will 
+     not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
-    if(devread)
-      retcode = devread(sobj, buf, size);
+    if(devread) {
+      if(fcb->streamfunc->unlocked)
+        retcode = devread(sobj, buf, size);
+      else {
+        kernel_lock();
+        retcode = devread(sobj, buf, size);
+        kernel_unlock();
+      }
+    }
 
     /* Need to decrease the reference to FCB */
-    FCB_decref(fcb);
+    put_fcb_ref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
 
 
   return retcode;
@@ -167,24 +211,27 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will 
+     not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
-    if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+    if(devwrite) {
+      if(fcb->streamfunc->unlocked)
+        retcode = devwrite(sobj, buf, size);
+      else {
+        kernel_lock();
+        retcode = devwrite(sobj, buf, size);
+        kernel_unlock();
+      }
+    }
 
     /* Need to decrease the reference to FCB */
-    FCB_decref(fcb);
+    put_fcb_ref(fcb);
 
   }
 
@@ -197,13 +244,19 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  PCB* cur = CURPROC;
+  FCB* fcb = NULL;
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+  if(retcode == 0) {
+    Mutex_Lock(&cur->FIDT_lock);
+    fcb = cur->FIDT[fd];
+    cur->FIDT[fd] = NULL;
+    Mutex_Unlock(&cur->FIDT_lock);
   }
 
+  if(fcb)
+    retcode = FCB_decref(fcb);
+
   return retcode;
 }
 
@@ -221,18 +274,23 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->FIDT_lock);
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
   if(old==NULL) {
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  Mutex_Unlock(&cur->FIDT_lock);
+
+  /* Release the replaced stream outside the FIDT lock */
+  if(old!=NULL && old!=new && new!=NULL)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -71,6 +71,9 @@ void FCB_incref(FCB* fcb);
 	Close method and returning its return value.
 	If the reference count is still >0, return 0. 
 
+	The reference count is atomic, but this must be called with the 
+	kernel lock held, since it may call the Close method.
+
 	@param fcb  the fcb whose reference count is decreased
 	@returns if the reference count is still >0, return 0, else return the value returned by the
 	     `Close()` operation
@@ -32,6 +32,13 @@ RET NAME SIG \
 	return __ret;\
 }\
 
+/* with return, without the kernel lock */
+#define SYSCALL_UNLOCKED(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
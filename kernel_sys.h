@@ -4,22 +4,32 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	System calls marked SYSCALL_UNLOCKED do not take the kernel lock.
+	They either touch no shared kernel state, or they lock what they touch
+	(e.g., @c Read and @c Write lock the FIDT of the process and the stream).
+ */
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL_UNLOCKED(GetPid, int, (void), ())\
+SYSCALL_UNLOCKED(GetPPid, int, (void), ())\
+SYSCALL(SetProcessWeight, int, (Pid_t pid, unsigned int weight), (pid, weight))\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL(CreateThreadAttr, Tid_t, (Task task, int argl, void* args, const thread_attr* attr), (task, argl, args, attr))\
+SYSCALL_UNLOCKED(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(ThreadSetAffinity, int, (Tid_t tid, coremask_t mask), (tid, mask))\
+SYSCALL(ThreadGetAffinity, int, (Tid_t tid, coremask_t* mask), (tid, mask))\
+SYSCALL(ThreadSetRealTime, int, (const rt_attr* attr), (attr))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_UNLOCKED(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_UNLOCKED(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
@@ -35,6 +45,9 @@ SYSCALL(OpenInfo, Fid_t, (), ())\
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
 
+#define SYSCALL_UNLOCKED(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
@@ -42,6 +55,7 @@ void sys_ ## NAME SIG;
 SYSCALLS
 
 #undef SYSCALL
+#undef SYSCALL_UNLOCKED
 #undef SYSCALLV
 
 #endif
\ No newline at end of file
@@ -14,7 +14,7 @@ void start_new_thread()
   int argl = cur_thread()->ptcb->argl;     /* Set argl as the argl from PTCB                            */
   void* args = cur_thread()->ptcb->args;   /* Set args as the args from PTCB                            */
   exitval = call(argl,args);               /* Load the result of "call(argl,args)", in our exit-integer */ 
-  sys_ThreadExit(exitval);                 /* Terminate the current thread                              */
+  ThreadExit(exitval);                     /* Terminate the current thread, holding the kernel lock     */
 }
 
 /** 
@@ -23,10 +23,26 @@ void start_new_thread()
 
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadAttr(task, argl, args, NULL);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+*/
+
+Tid_t sys_CreateThreadAttr(Task task, int argl, void* args, const thread_attr* attr)
+{
+  size_t stack_size = THREAD_STACK_SIZE;
+  if(attr != NULL && attr->stack_size != 0) {
+    if(attr->stack_size > THREAD_STACK_MAX)
+      return NOTHREAD;
+    stack_size = attr->stack_size;
+  }
+
 /**********************************************************************************************************************************************************************/
   assert(task != NULL);                                           /*            Just to be sure that "task != null", before accessing it                              */
   PTCB* NewPTCB= (PTCB*)xmalloc(sizeof(PTCB));                    /*                           Allocates a PTCB-space                                                 */
-  TCB* NewTCB = spawn_thread(CURPROC,start_new_thread);           /* This call creates a new thread, initializing and returning its TCB.The thread will belong to PCB */
+  TCB* NewTCB = spawn_thread(CURPROC,start_new_thread,stack_size);/* This call creates a new thread, initializing and returning its TCB.The thread will belong to PCB */
   NewPTCB->task = task;                                           /*  \                                                                                               */
   NewPTCB->argl = argl;                                           /*   \                                                                                              */
   NewPTCB->args = args;                                           /*    \                                                                                             */                         
@@ -39,6 +55,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   NewTCB->ptcb = NewPTCB;                                         /* Connect the TCB's PTCB, with our NewPTCB                                                         */
   NewPTCB->tcb = NewTCB;                                          /* Connect the PTCB's TCB, with our NewTCB                                                          */
   rlist_push_back(&CURPROC->ptcb_list,&NewPTCB->ptcb_list_node);  /* Adds the new PTCB in the (end of) the list                                                       */
+  NewTCB->affinity = cur_thread()->affinity;                      /* The new thread runs where its creator may run                                                    */
   wakeup(NewTCB);                                                 /* Prepares the informed NewTCB and put it into the proper queue(with select...)                    */
 /**********************************************************************************************************************************************************************/
   return (Tid_t)NewPTCB;
@@ -111,6 +128,61 @@ int sys_ThreadDetach(Tid_t tid)
 /********************************************************************************************************************************************************/
 }
 
+/*
+  Return the TCB of a live thread of the current process, or NULL.
+*/
+static TCB* find_live_thread(Tid_t tid)
+{
+  PTCB* ptcb = (PTCB*) tid;
+
+  if(tid == NOTHREAD || rlist_find(&CURPROC->ptcb_list, ptcb, NULL) == NULL || ptcb->exited)
+    return NULL;
+  return ptcb->tcb;
+}
+
+/**
+  @brief Set the cores that a thread may run on.
+*/
+
+int sys_ThreadSetAffinity(Tid_t tid, coremask_t mask)
+{
+  TCB* tcb = find_live_thread(tid);
+  if(tcb == NULL || tcb->rt)
+    return -1;
+
+  /* Some existing core must be in the mask */
+  uint ncores = cpu_cores();
+  coremask_t existing = (ncores < 32) ? (1u << ncores) - 1 : ALL_CORES;
+  if((mask & existing) == 0)
+    return -1;
+
+  set_thread_affinity(tcb, mask & existing);
+  return 0;
+}
+
+/**
+  @brief Get the cores that a thread may run on.
+*/
+
+int sys_ThreadGetAffinity(Tid_t tid, coremask_t* mask)
+{
+  TCB* tcb = find_live_thread(tid);
+  if(tcb == NULL)
+    return -1;
+
+  *mask = tcb->affinity;
+  return 0;
+}
+
+/**
+  @brief Make the current thread a real-time thread.
+*/
+
+int sys_ThreadSetRealTime(const rt_attr* attr)
+{
+  return set_thread_realtime(attr);
+}
+
 /**
   @brief Terminate the current thread.
 */
@@ -72,11 +72,17 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex records the thread that holds it, so that a waiting thread can
+    lend its priority to the holder.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  char lock;            /**< 0 if free, 1 if locked, 2 if locked and threads may sleep on it */
+  void* owner;          /**< The thread holding the mutex, or NULL */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,13 +92,16 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL })
 
 
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the caller sleeps on a wait queue of the mutex,
+  after spinning for a while if there are other cores. Before sleeping, the caller
+  lends its priority to the holder of the mutex, which keeps it until it unlocks 
+  the mutex. A caller that has slept for long gets the mutex handed to it on unlock.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -133,7 +142,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, { 0, NULL } })
 
 
 /** @brief Wait on a condition variable. 
@@ -202,6 +211,77 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief Reader-writer locks.
+
+  A reader-writer lock is held either by any number of readers, or by a 
+  single writer. It is meant for read-mostly data, whose readers need 
+  not exclude each other.
+
+  Writers get preference: while a writer waits, new readers wait too,
+  so that writers are not starved by a stream of readers. Read-locking
+  a lock that is not held by a writer (and not awaited by one) takes a 
+  single atomic operation.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  unsigned int state;   /**< The number of readers, and flags for writers and waiters */
+  int writers_waiting;  /**< The number of writers waiting, protected by @c mx */
+  Mutex mx;             /**< A mutex to protect the waiting */
+  CondVar readers;      /**< Readers wait here */
+  CondVar writers;      /**< Writers wait here */
+} RWLock;
+
+/** @brief This macro is used to initialize reader-writer locks.
+
+   It is used as follows:
+  @code
+  RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ 0, 0, MUTEX_INIT, COND_INIT, COND_INIT })
+
+/** @brief Lock a reader-writer lock for reading.
+
+  Wait as long as a writer holds the lock, or waits for it. 
+  @see RWLock_ReadUnlock
+  */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for reading, waiting for a limited time.
+
+  @param rw the lock
+  @param timeout The time in milliseconds to wait for the lock.
+  @returns 1 if the lock was taken, 0 if the timeout expired
+  @see RWLock_ReadLock
+  */
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Unlock a reader-writer lock that you locked for reading. */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing.
+
+  Wait as long as readers or another writer hold the lock.
+  @see RWLock_WriteUnlock
+  */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing, waiting for a limited time.
+
+  @param rw the lock
+  @param timeout The time in milliseconds to wait for the lock.
+  @returns 1 if the lock was taken, 0 if the timeout expired
+  @see RWLock_WriteLock
+  */
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Unlock a reader-writer lock that you locked for writing. */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
 /*******************************************
  *
  * Process creation
@@ -291,6 +371,29 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The default weight of a process. */
+#define PROC_WEIGHT_DEFAULT 1024
+
+/** @brief The maximum weight of a process. */
+#define PROC_WEIGHT_MAX (1024*PROC_WEIGHT_DEFAULT)
+
+/** @brief Set the scheduling weight of a process.
+
+  When the kernel is booted in fair-share mode (see @ref boot_options), 
+  the CPU time is divided among the processes in proportion to their
+  weight, and the time of each process is divided equally among its 
+  threads. Otherwise, the weight has no effect.
+
+  A new process inherits the weight of its parent. 
+
+  @param pid the process, or @c NOPROC for the current process
+  @param weight the new weight, between 1 and @c PROC_WEIGHT_MAX
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - @c pid is not the pid of a live process.
+    - @c weight is out of range.
+ */
+int SetProcessWeight(Pid_t pid, unsigned int weight);
+
 /*******************************************
  *
  * Threads
@@ -319,6 +422,39 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+
+/** 
+  @brief Attributes of a new thread.
+
+  A field equal to 0 selects the default value for it.
+
+  @see CreateThreadAttr
+  */
+typedef struct thread_attr {
+  unsigned int stack_size;  /**< @brief The size of the thread's stack, in bytes. */
+} thread_attr;
+
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This is the same as @c CreateThread, except that the new thread is created 
+  according to @c attr. If @c attr is @c NULL, the defaults are used. 
+
+  The stack of the thread is rounded up to a whole number of pages. Stack
+  pages only take up memory once they are used, and overflowing the stack
+  crashes the program.
+
+  @param task a function to execute
+  @param argl passed to @c task
+  @param args passed to @c task
+  @param attr the thread attributes, or @c NULL
+  @returns the Tid of the new thread, or @c NOTHREAD if the attributes are
+    invalid (the stack size is larger than 64 Mbytes).
+  @see CreateThread
+  */
+Tid_t CreateThreadAttr(Task task, int argl, void* args, const thread_attr* attr);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -375,6 +511,92 @@ int ThreadDetach(Tid_t tid);
 void ThreadExit(int exitval);
 
 
+/**
+  @brief A set of cores.
+
+  Core @c c is in the set if bit @c c is set.
+  */
+typedef uint32_t coremask_t;
+
+/** @brief The set of all cores. */
+#define ALL_CORES ((coremask_t)-1)
+
+/**
+  @brief Set the cores that a thread may run on.
+
+  The scheduler will only run thread @c tid on the cores in @c mask.
+  This can be used to keep a thread on the same core, or to keep threads
+  away from some cores. If @c tid is the current thread and the current 
+  core is not in @c mask, the thread moves to another core before this 
+  call returns.
+
+  Cores in @c mask that do not exist are ignored. New threads inherit
+  the affinity of the thread that created them, whereas the main
+  thread of a new process may run on all cores.
+
+  @param tid the thread
+  @param mask the set of cores
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the tid corresponds to a real-time thread.
+    - @c mask contains no existing core.
+  @see ThreadGetAffinity
+  */
+int ThreadSetAffinity(Tid_t tid, coremask_t mask);
+
+/**
+  @brief Get the cores that a thread may run on.
+
+  @param tid the thread
+  @param mask a location where to store the set of cores
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  @see ThreadSetAffinity
+  */
+int ThreadGetAffinity(Tid_t tid, coremask_t* mask);
+
+
+/**
+  @brief Real-time parameters of a thread.
+
+  All times are in microseconds, and must satisfy
+  0 < @c runtime <= @c deadline <= @c period <= 10 sec.
+
+  @see ThreadSetRealTime
+  */
+typedef struct rt_attr {
+  unsigned long runtime;   /**< @brief The CPU time of each job */
+  unsigned long deadline;  /**< @brief The time from the start of a job to its deadline */
+  unsigned long period;    /**< @brief The minimum time between the starts of two jobs */
+} rt_attr;
+
+/**
+  @brief Make the current thread a real-time thread.
+
+  A real-time thread runs jobs: a job starts when the thread wakes up 
+  (or at the start of its next period, if it wakes up earlier), and ends 
+  when it sleeps. Real-time threads run ahead of all other threads, 
+  earliest deadline first, and a job that runs for at most @c runtime 
+  meets its deadline. A job that runs for longer is suspended until the
+  next period.
+
+  Each real-time thread is bound to a core, chosen among the cores of its
+  affinity. The call fails if no such core has enough spare capacity for 
+  the thread, so that real-time threads can never take up a whole core.
+  Afterwards, the affinity of the thread is set to its core, and it cannot
+  be changed while the thread is real-time.
+
+  @param attr the real-time parameters, or @c NULL to make the thread a
+    normal thread again
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - the parameters are invalid.
+    - there is not enough capacity for the thread.
+  */
+int ThreadSetRealTime(const rt_attr* attr);
+
+
 
 /*******************************************
  *
@@ -736,6 +958,11 @@ typedef struct procinfo
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+
+  unsigned int weight;    /**< @brief The scheduling weight of the process. */
+  unsigned long cpu_time; /**< @brief The CPU time used by the threads of the process, in microseconds. */
+  unsigned long share;    /**< @brief The @c cpu_time of the process, in parts per million of the 
+                              total @c cpu_time of all processes when the stream was opened. */
 } procinfo;
 
 
@@ -777,10 +1004,56 @@ Fid_t OpenInfo();
 
    When the boot_task process finishes, this call halts and cleans up TinyOS structures 
    and then returns. 
+
+   The kernel is booted with the default options.
+
+   @see boot_with_options
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Kernel options, given at boot.
+
+  These options tune the kernel. A field equal to 0 selects the
+  default value for it.
+
+  @see boot_with_options
+  */
+typedef struct boot_options {
+  unsigned long quantum;      /**< @brief The scheduling quantum, in microseconds */
+  unsigned long boost_period; /**< @brief The interval between priority boosts, in microseconds */
+  unsigned long thread_cache; /**< @brief The number of free thread stacks that each core keeps for reuse */
+  int fair_share;             /**< @brief Non-zero to share the CPU among processes by weight, 
+                                   instead of by the priorities of their threads. @see SetProcessWeight */
+  int fixed_quantum;          /**< @brief Non-zero to give every time-slice the whole quantum, 
+                                   instead of adapting it to the behaviour of each thread */
+  int no_balancing;           /**< @brief Non-zero to disable the periodic load balancer, which moves
+                                   ready threads from busy cores to idle ones */
+  int no_parking;             /**< @brief Non-zero to keep all cores active, instead of parking the
+                                   cores that stay idle */
+  unsigned long park_delay;   /**< @brief How long a core must stay idle before it parks, in microseconds */
+  unsigned long unpark_depth; /**< @brief How many more threads must be queued than there are idle cores,
+                                   for a parked core to be unparked */
+  int tas_spinlocks;          /**< @brief Non-zero to make the spinlocks of the scheduler test-and-set locks,
+                                   instead of queue locks, e.g., to compare the two */
+  int no_wait_morphing;       /**< @brief Non-zero to wake up the threads signalled on a condition variable,
+                                   instead of moving them to the wait queue of their mutex, while it is held */
+  const char* trace_file;     /**< @brief If not NULL, the scheduler records its events, and writes 
+                                   them to this file at shutdown, in Chrome trace-event JSON format */
+} boot_options;
+
+
+/** @brief Boot tinyos3 with the given options.
+
+   This is the same as @ref boot, except that the kernel is tuned by 
+   @c options. If @c options is @c NULL, the defaults are used.
+
+   @see boot
+   */
+void boot_with_options(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args,
+  const boot_options* options);
+
+
 /** @} */
 
 #endif
@@ -463,6 +463,28 @@ void sendme(uint term, const char* pattern)
 	term_proxy_sendme(& PROXY[term], pattern);
 }
 
+procinfo get_procinfo(Pid_t pid)
+{
+	procinfo info;
+	int found = 0;
+	Fid_t fid = OpenInfo();
+	while(!found && Read(fid, (char*)&info, sizeof(info)) == sizeof(info))
+		found = (info.pid == pid);
+	Close(fid);
+	if(!found)
+		info.pid = NOPROC;
+	return info;
+}
+
+void sleep_msec(timeout_t msec)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, msec);
+	Mutex_Unlock(&mx);
+}
+
 
 
 /* Execute procfunc in a subprocess, return 
@@ -304,6 +304,16 @@ void expect(uint term, const char* pattern);
 */
 void sendme(uint term, const char* pattern);
 
+/** @brief Return the info of a process from @c OpenInfo.
+
+	If there is no process with the given pid, the returned info
+	has @c pid equal to @c NOPROC.
+ */
+procinfo get_procinfo(Pid_t pid);
+
+/** @brief Put the current thread to sleep for about @c msec milliseconds. */
+void sleep_msec(timeout_t msec);
+
 
 /** @brief Fill in the bytes of a variable with a weird value:  10101010 or 0xAA 
 */
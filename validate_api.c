@@ -10,6 +10,7 @@
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
+#include "kernel_sched.h"
 
 
 /*
@@ -69,6 +70,236 @@ BARE_TEST(test_boot,
 }
 
 
+BARE_TEST(test_boot_with_options, 
+	"Test that the boot_with_options(...) function initializes the VM\n"
+	"and passes arguments to the init task correctly, with and without\n"
+	"options.")
+{
+	struct test_cpu_rec cpu_rec;
+	struct test_cpu_rec* cpu_rec_ptr = &cpu_rec;
+
+	boot_options opts = { .quantum = 1000, .boost_period = 5000 };
+	const boot_options* optlist[] = { &opts, NULL };
+
+	for(int i=0; i<2; i++) {
+		FUDGE(cpu_rec);
+		boot_with_options(2,0, test_boot_boot, sizeof(cpu_rec_ptr), &cpu_rec_ptr, optlist[i]);
+
+		ASSERT(cpu_rec.argl == sizeof(cpu_rec_ptr));
+		ASSERT( cpu_rec.rec == &cpu_rec );
+		ASSERT(cpu_rec.nterm == 0);
+		ASSERT(cpu_rec.ncores == 2);
+	}
+}
+
+
+
+static volatile int fair_stop;
+
+static int fair_spin_task(int argl, void* args)
+{
+	while(! fair_stop)
+		fibo(15);
+	return 0;
+}
+
+/* A process spinning on argl threads */
+static int fair_proc_task(int argl, void* args)
+{
+	Tid_t t[argl];
+	for(int i=1; i<argl; i++)
+		t[i] = CreateThread(fair_spin_task, 0, NULL);
+	fair_spin_task(0, NULL);
+	for(int i=1; i<argl; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+struct fair_rec { 
+	unsigned long equal[2], weighted[2];
+	unsigned int weight;
+};
+
+/* Measure the CPU time that processes a and b get over one second */
+static void fair_measure(Pid_t a, Pid_t b, unsigned long* delta)
+{
+	unsigned long a0 = get_procinfo(a).cpu_time, b0 = get_procinfo(b).cpu_time;
+	sleep_msec(1000);
+	delta[0] = get_procinfo(a).cpu_time - a0;
+	delta[1] = get_procinfo(b).cpu_time - b0;
+}
+
+static int fair_boot(int argl, void* args)
+{
+	struct fair_rec* rec = *(struct fair_rec**)args;
+
+	fair_stop = 0;
+	Pid_t a = Exec(fair_proc_task, 1, NULL);
+	Pid_t b = Exec(fair_proc_task, 4, NULL);
+
+	sleep_msec(200);
+	fair_measure(a, b, rec->equal);
+
+	SetProcessWeight(a, 3*PROC_WEIGHT_DEFAULT);
+	rec->weight = get_procinfo(a).weight;
+	sleep_msec(200);
+	fair_measure(a, b, rec->weighted);
+
+	fair_stop = 1;
+	while(WaitChild(NOPROC, NULL) != NOPROC);
+	return 0;
+}
+
+BARE_TEST(test_fair_share,
+	"Test that, when booted in fair-share mode, the kernel divides the CPU\n"
+	"among processes by weight, regardless of their number of threads, and\n"
+	"reports the CPU time of each process through OpenInfo.",
+	.timeout = 20)
+{
+	struct fair_rec rec;
+	struct fair_rec* rec_ptr = &rec;
+	boot_options opts = { .fair_share = 1 };
+	boot_with_options(1, 0, fair_boot, sizeof(rec_ptr), &rec_ptr, &opts);
+
+	/* Process a has 1 thread and process b has 4 */
+	double equal = (double) rec.equal[0] / (rec.equal[0] + rec.equal[1]);
+	double weighted = (double) rec.weighted[0] / (rec.weighted[0] + rec.weighted[1]);
+	ASSERT_MSG(0.35 < equal && equal < 0.65, "share %.2f with equal weights\n", equal);
+	ASSERT_MSG(0.6 < weighted && weighted < 0.9, "share %.2f with weights 3:1\n", weighted);
+	ASSERT(rec.weight == 3*PROC_WEIGHT_DEFAULT);
+}
+
+
+static int trace_sleeper(int argl, void* args)
+{
+	sleep_msec(5);
+	return 0;
+}
+
+static int trace_boot(int argl, void* args)
+{
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(trace_sleeper, 0, NULL);
+	for(int i=0; i<4; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+BARE_TEST(test_sched_trace,
+	"Test that, when booted with a trace file, the kernel writes the scheduler\n"
+	"events to it at shutdown, in Chrome trace-event JSON format."
+	)
+{
+	char filename[] = "/tmp/tinyos_trace_XXXXXX";
+	int fd = mkstemp(filename);
+	ASSERT(fd >= 0);
+	close(fd);
+
+	boot_options opts = { .trace_file = filename };
+	boot_with_options(2, 0, trace_boot, 0, NULL, &opts);
+
+	FILE* f = fopen(filename, "r");
+	ASSERT(f != NULL);
+	static char text[1 << 22];
+	size_t len = fread(text, 1, sizeof(text)-1, f);
+	text[len] = 0;
+	fclose(f);
+	unlink(filename);
+
+	ASSERT(strncmp(text, "{\"traceEvents\":[", 16) == 0);
+	ASSERT(len > 4 && strcmp(text + len - 4, "\n]}\n") == 0);
+	ASSERT(strstr(text, "\"ph\":\"X\"") != NULL);
+	ASSERT(strstr(text, "\"name\":\"wakeup\"") != NULL);
+	ASSERT(strstr(text, "\"name\":\"sleep\"") != NULL);
+	ASSERT(strstr(text, "\"name\":\"timeout\"") != NULL);
+}
+
+
+static volatile int park_started;
+
+/* Spin until all the spinners have started, and then for a while */
+static int park_spinner(int argl, void* args)
+{
+	__atomic_add_fetch(&park_started, 1, __ATOMIC_SEQ_CST);
+	TimerDuration t0 = bios_clock();
+	while(park_started < argl && bios_clock() < t0 + 1000000);
+	for(t0 = bios_clock(); bios_clock() < t0 + 50000; );
+	return park_started >= argl;
+}
+
+/* The mask of the parked cores, from their statistics */
+static coremask_t park_mask()
+{
+	coremask_t mask = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		if(__atomic_load_n(&cctx[c].stats.parks, __ATOMIC_RELAXED) 
+			> __atomic_load_n(&cctx[c].stats.unparks, __ATOMIC_RELAXED))
+			mask |= 1u << c;
+	return mask;
+}
+
+/* Wait for up to a second for some core to park, and return the parked cores */
+static coremask_t park_wait()
+{
+	coremask_t mask;
+	for(int i=0; i<100 && (mask = park_mask()) == 0; i++)
+		sleep_msec(10);
+	return mask;
+}
+
+static unsigned long park_unparks()
+{
+	unsigned long unparks = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		unparks += __atomic_load_n(&cctx[c].stats.unparks, __ATOMIC_RELAXED);
+	return unparks;
+}
+
+static int park_boot(int argl, void* args)
+{
+	/* Let the other cores park */
+	coremask_t parked = park_wait();
+	ASSERT(parked != 0);
+
+	/* A thread pinned to a parked core unparks it */
+	uint last = 31 - __builtin_clz(parked);
+	unsigned long unparks = park_unparks();
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u << last)==0);
+	ASSERT(cpu_core_id == last);
+	ASSERT(park_unparks() > unparks);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), ALL_CORES)==0);
+
+	/* A backlog unparks an idle core */
+	ASSERT(park_wait() != 0);
+	unparks = park_unparks();
+	Tid_t t[4];
+	park_started = 0;
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(park_spinner, 4, NULL);
+	for(int i=0; i<4; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval)==0);
+		ASSERT(exitval == 1);
+	}
+	ASSERT(park_unparks() > unparks);
+
+	/* Core 0 never parks */
+	ASSERT(cctx[0].stats.parks == 0);
+	return 0;
+}
+
+BARE_TEST(test_core_parking,
+	"Test that, when the cores park after a short idle time, they are unparked\n"
+	"for threads that may only run on them, and when threads queue up. Core 0\n"
+	"never parks."
+	)
+{
+	boot_options opts = { .park_delay = 10000 };
+	boot_with_options(4, 0, park_boot, 0, NULL, &opts);
+}
+
+
 
 
 /*********************************************
@@ -100,6 +331,17 @@ BOOT_TEST(test_pid_of_init_is_one,
 }
 
 
+BOOT_TEST(test_get_procinfo_of_missing_pid,
+	"Test that get_procinfo returns NOPROC as the pid, when there is no\n"
+	"process with the given pid."
+	)
+{
+	ASSERT(get_procinfo(GetPid()).pid == GetPid());
+	ASSERT(get_procinfo(GetPid()+1).pid == NOPROC);
+	ASSERT(get_procinfo(MAX_PROC).pid == NOPROC);
+	return 0;
+}
+
 
 static void waitchild_error()
 {
@@ -509,6 +751,204 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+/*
+	Test that a mutex contended by many threads provides mutual exclusion, 
+	as threads sleep on it and have it handed to them.
+ */
+
+static Mutex contended_mx;
+static int contended_count;
+
+static int mutex_incrementer(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&contended_mx);
+		int c = contended_count;
+		fibo(10);
+		contended_count = c+1;
+		Mutex_Unlock(&contended_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a mutex contended by many threads provides mutual exclusion."
+	)
+{
+	const int N = 16, M = 2000;
+	Tid_t t[N];
+
+	contended_mx = MUTEX_INIT;
+	contended_count = 0;
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(mutex_incrementer, M, NULL);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	ASSERT(contended_count == N*M);
+	return 0;
+}
+
+
+/*
+	Test that the waiters of a broadcast, moved to the mutex while it is
+	held, each get the mutex in turn, also when their timeouts expire
+	while they wait for it.
+ */
+
+static Mutex morph_mx;
+static CondVar morph_cv;
+static int morph_round, morph_inside;
+
+static int morph_waiter(int argl, void* args)
+{
+	int bad = 0;
+	Mutex_Lock(&morph_mx);
+	for(int r=1; r<=argl; r++) {
+		while(morph_round < r)
+			Cond_TimedWait(&morph_mx, &morph_cv, 1);
+		if(morph_inside++) bad = 1;
+		fibo(5);
+		morph_inside--;
+	}
+	Mutex_Unlock(&morph_mx);
+	return bad;
+}
+
+BOOT_TEST(test_cond_broadcast_morph,
+	"Test that the waiters of a broadcast get the mutex in turn, also when their\n"
+	"timeouts expire while the mutex is held."
+	)
+{
+	const int N = 8, R = 50;
+	Tid_t t[N];
+
+	morph_mx = MUTEX_INIT;
+	morph_cv = COND_INIT;
+	morph_round = morph_inside = 0;
+	for(int i=0; i<N; i++)
+		t[i] = CreateThread(morph_waiter, R, NULL);
+
+	for(int r=1; r<=R; r++) {
+		Mutex_Lock(&morph_mx);
+		morph_round = r;
+		Cond_Broadcast(&morph_cv);
+		fibo(24);
+		Mutex_Unlock(&morph_mx);
+	}
+
+	for(int i=0; i<N; i++) {
+		int bad;
+		ASSERT(ThreadJoin(t[i], &bad)==0);
+		ASSERT(bad == 0);
+	}
+	return 0;
+}
+
+
+/*
+	Test that a reader-writer lock excludes writers from readers and from
+	each other, while readers and writers run on all cores.
+ */
+
+static RWLock test_rw;
+static volatile int rw_a, rw_b;
+
+static int rw_reader_task(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		RWLock_ReadLock(&test_rw);
+		int a = rw_a;
+		fibo(8);
+		int b = rw_b;
+		RWLock_ReadUnlock(&test_rw);
+		if(a != b) return -1;
+	}
+	return 0;
+}
+
+static int rw_writer_task(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		RWLock_WriteLock(&test_rw);
+		rw_a++;
+		fibo(8);
+		rw_b++;
+		RWLock_WriteUnlock(&test_rw);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_exclusion,
+	"Test that a reader-writer lock excludes the writers from the readers,\n"
+	"and from each other."
+	)
+{
+	const int R = 6, W = 2, N = 2000;
+	Tid_t t[R+W];
+
+	test_rw = RWLOCK_INIT;
+	rw_a = rw_b = 0;
+	for(int i=0; i<R+W; i++)
+		t[i] = CreateThread((i<R) ? rw_reader_task : rw_writer_task, N, NULL);
+
+	for(int i=0; i<R+W; i++) {
+		int rc = -1;
+		ASSERT(ThreadJoin(t[i], &rc)==0);
+		ASSERT(rc == 0);
+	}
+	ASSERT(rw_a == W*N && rw_b == W*N);
+	return 0;
+}
+
+
+static int rw_timed_writer(int argl, void* args)
+{
+	if(argl > 0)
+		return RWLock_TimedWriteLock(&test_rw, argl);
+	RWLock_WriteLock(&test_rw);
+	RWLock_WriteUnlock(&test_rw);
+	return 1;
+}
+
+BOOT_TEST(test_rwlock_writer_preference,
+	"Test the timed locking of a reader-writer lock, and that readers wait\n"
+	"while a writer waits."
+	)
+{
+	int rc = -1;
+	test_rw = RWLOCK_INIT;
+
+	/* Readers share the lock */
+	RWLock_ReadLock(&test_rw);
+	ASSERT(RWLock_TimedReadLock(&test_rw, 0) == 1);
+	RWLock_ReadUnlock(&test_rw);
+
+	/* A writer times out while we read */
+	Tid_t t = CreateThread(rw_timed_writer, 20, NULL);
+	ASSERT(ThreadJoin(t, &rc) == 0);
+	ASSERT(rc == 0);
+
+	/* While a writer waits, new readers wait too */
+	t = CreateThread(rw_timed_writer, 0, NULL);
+	sleep_msec(20);
+	ASSERT(RWLock_TimedReadLock(&test_rw, 20) == 0);
+	RWLock_ReadUnlock(&test_rw);
+	ASSERT(ThreadJoin(t, &rc) == 0);
+	ASSERT(rc == 1);
+
+	/* A writer excludes everyone */
+	ASSERT(RWLock_TimedWriteLock(&test_rw, 0) == 1);
+	ASSERT(RWLock_TimedReadLock(&test_rw, 10) == 0);
+	ASSERT(RWLock_TimedWriteLock(&test_rw, 10) == 0);
+	RWLock_WriteUnlock(&test_rw);
+
+	ASSERT(RWLock_TimedReadLock(&test_rw, 0) == 1);
+	RWLock_ReadUnlock(&test_rw);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -903,7 +1343,12 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_boot_with_options,
+	&test_fair_share,
+	&test_sched_trace,
+	&test_core_parking,
 	&test_pid_of_init_is_one,
+	&test_get_procinfo_of_missing_pid,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
 	&test_exec_getpid_wait,
@@ -915,6 +1360,10 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_mutex_contention,
+	&test_cond_broadcast_morph,
+	&test_rwlock_exclusion,
+	&test_rwlock_writer_preference,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1161,6 +1610,36 @@ BOOT_TEST(test_join_many_threads,
 }
 
 
+static int churn_thread(int argl, void* args) { return argl; }
+
+static int churn_creator(int argl, void* args)
+{
+	Tid_t tids[16];
+	for(int i=0;i<1000;i++) {
+		for(int j=0;j<16;j++)
+			tids[j] = CreateThread(churn_thread, j, NULL);
+		for(int j=0;j<16;j++) {
+			int exitval;
+			ASSERT(ThreadJoin(tids[j], &exitval)==0);
+			ASSERT(exitval==j);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_thread_churn,
+	"Test that threads of a process can create and join many threads\n"
+	"at the same time, so that threads keep exiting on every core.")
+{
+	Tid_t tids[4];
+	for(int i=0;i<4;i++)
+		tids[i] = CreateThread(churn_creator, 0, NULL);
+	for(int i=0;i<4;i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
 
 static Tid_t mttid;
 
@@ -1393,6 +1872,288 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+/* Use about depth kbytes of stack */
+static int stack_user(int depth)
+{
+	volatile char frame[1024];
+	frame[0] = 1;
+	if(depth == 0) return 0;
+	return frame[0] + stack_user(depth-1);
+}
+
+static int stack_user_task(int argl, void* args)
+{
+	return stack_user(argl);
+}
+
+BOOT_TEST(test_create_thread_attr,
+	"Test that threads can be created with a given stack size, and\n"
+	"that they can use all of it. Also, that invalid stack sizes fail."
+	)
+{
+	thread_attr big = { .stack_size = 2*1024*1024 };
+	thread_attr tiny = { .stack_size = 1 };
+	thread_attr dflt = { .stack_size = 0 };
+	thread_attr huge = { .stack_size = 1024*1024*1024 };
+	int exitval;
+
+	Tid_t t = CreateThreadAttr(stack_user_task, 1500, NULL, &big);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 1500);
+
+	t = CreateThreadAttr(stack_user_task, 4, NULL, &tiny);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 4);
+
+	t = CreateThreadAttr(stack_user_task, 64, NULL, &dflt);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 64);
+
+	t = CreateThreadAttr(stack_user_task, 64, NULL, NULL);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 64);
+
+	ASSERT(CreateThreadAttr(stack_user_task, 0, NULL, &huge) == NOTHREAD);
+	return 0;
+}
+
+
+static int affinity_task(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* Check the core at a few points where we may have been moved */
+	for(int i=0; i<20; i++) {
+		if(cpu_core_id != argl) return -1;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 1);
+		Mutex_Unlock(&mx);
+	}
+	return (cpu_core_id == argl) ? 0 : -1;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that a thread only runs on the cores of its affinity, that new\n"
+	"threads inherit the affinity of their creator, and that invalid\n"
+	"masks and threads give errors.",
+	.minimum_cores = 2
+	)
+{
+	uint last = cpu_cores()-1;
+	coremask_t mask;
+
+	ASSERT(ThreadGetAffinity(ThreadSelf(), &mask)==0);
+	ASSERT(mask == ALL_CORES);
+
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 0)==-1);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u << cpu_cores())==-1 || cpu_cores()==32);
+	ASSERT(ThreadSetAffinity(NOTHREAD, 1)==-1);
+	ASSERT(ThreadGetAffinity(NOTHREAD, &mask)==-1);
+
+	/* Move to the last core */
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1u << last)==0);
+	ASSERT(cpu_core_id == last);
+	ASSERT(ThreadGetAffinity(ThreadSelf(), &mask)==0);
+	ASSERT(mask == 1u << last);
+
+	/* The child starts pinned to the same core */
+	Tid_t t = CreateThread(affinity_task, last, NULL);
+	ASSERT(ThreadGetAffinity(t, &mask)==0);
+	ASSERT(mask == 1u << last);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 0);
+
+	/* Move another thread to core 0. It may have started on the last
+	   core, so its exit value is not checked. */
+	t = CreateThread(affinity_task, 0, NULL);
+	ASSERT(ThreadSetAffinity(t, 1)==0);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+
+	/* Move back to core 0 */
+	ASSERT(ThreadSetAffinity(ThreadSelf(), 1)==0);
+	ASSERT(cpu_core_id == 0);
+	t = CreateThread(affinity_task, 0, NULL);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 0);
+
+	/* Exited threads have no affinity */
+	ASSERT(ThreadSetAffinity(t, 1)==-1);
+	return 0;
+}
+
+
+
+#define RT_PERIOD 50000
+#define RT_JOBS 20
+
+static volatile int rt_background_stop;
+
+/* CPU-bound background load, as in the symposium */
+static int rt_background_task(int argl, void* args)
+{
+	while(! rt_background_stop)
+		fibo(20);
+	return 0;
+}
+
+BOOT_TEST(test_realtime_deadlines,
+	"Test that a real-time thread meets its deadlines, while CPU-bound\n"
+	"threads keep all cores busy, and that admission control rejects\n"
+	"invalid or excessive parameters.",
+	.timeout = 60
+	)
+{
+	rt_attr bad[] = {
+		{ .runtime = 0, .deadline = 1000, .period = 1000 },
+		{ .runtime = 2000, .deadline = 1000, .period = 1000 },
+		{ .runtime = 1000, .deadline = 2000, .period = 1000 },
+		{ .runtime = 1000, .deadline = 1000, .period = 20000000 },
+		{ .runtime = 960, .deadline = 1000, .period = 1000 }
+	};
+	for(int i=0; i < sizeof(bad)/sizeof(bad[0]); i++)
+		ASSERT(ThreadSetRealTime(&bad[i]) == -1);
+
+	/* Keep all cores busy */
+	uint nbg = 2*cpu_cores();
+	Tid_t bg[nbg];
+	rt_background_stop = 0;
+	for(uint i=0; i<nbg; i++)
+		bg[i] = CreateThread(rt_background_task, 0, NULL);
+
+	/* Budgets are charged in real time, so leave room for slow hosts */
+	rt_attr attr = { .runtime = 4*RT_PERIOD/5, .deadline = RT_PERIOD, .period = RT_PERIOD };
+	ASSERT(ThreadSetRealTime(&attr) == 0);
+
+	coremask_t mask;
+	ASSERT(ThreadGetAffinity(ThreadSelf(), &mask) == 0);
+	ASSERT(mask == 1u << cpu_core_id);
+	ASSERT(ThreadSetAffinity(ThreadSelf(), ALL_CORES) == -1);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int misses = 0;
+	TimerDuration start = bios_clock();
+
+	for(int k=0; k<RT_JOBS; k++) {
+		/* Sleep until the release of job k */
+		TimerDuration release = start + k*RT_PERIOD;
+		TimerDuration now = bios_clock();
+		if(now < release) {
+			Mutex_Lock(&mx);
+			Cond_TimedWait(&mx, &cv, (release - now + 999)/1000);
+			Mutex_Unlock(&mx);
+		}
+
+		/* Compute for 2 msec */
+		TimerDuration t0 = bios_clock();
+		while(bios_clock() < t0 + 2000) 
+			fibo(10);
+
+		if(bios_clock() > release + RT_PERIOD)
+			misses++;
+	}
+
+	ASSERT(ThreadSetRealTime(NULL) == 0);
+	ASSERT(misses == 0);
+
+	rt_background_stop = 1;
+	for(uint i=0; i<nbg; i++)
+		ASSERT(ThreadJoin(bg[i], NULL) == 0);
+	return 0;
+}
+
+
+
+/*
+	Priority inversion: a thread of low priority holds a mutex that a thread
+	of high priority needs, while a CPU-bound thread of middle priority 
+	keeps the only core busy.
+ */
+static Mutex pi_mutex;
+static volatile int pi_locked, pi_done;
+
+/* Compute for msec of CPU time, not counting the time that other threads run */
+static void pi_compute(long msec)
+{
+	long left = msec*1000;
+	TimerDuration t = bios_clock();
+	while(left > 0) {
+		fibo(5);
+		TimerDuration now = bios_clock();
+		if(now - t < 100)
+			left -= now - t;
+		t = now;
+	}
+}
+
+static int pi_low_task(int argl, void* args)
+{
+	/* Sink a few hundred priority levels, before taking the mutex */
+	pi_compute(300);
+	Mutex_Lock(&pi_mutex);
+	pi_locked = 1;
+	pi_compute(20);
+	Mutex_Unlock(&pi_mutex);
+	return 0;
+}
+
+static int pi_middle_task(int argl, void* args)
+{
+	while(! pi_done)
+		fibo(10);
+	return 0;
+}
+
+static int pi_high_task(int argl, void* args)
+{
+	TimerDuration start = bios_clock();
+	Mutex_Lock(&pi_mutex);
+	**(TimerDuration**)args = bios_clock() - start;
+	Mutex_Unlock(&pi_mutex);
+	pi_done = 1;
+	return 0;
+}
+
+static int pi_boot(int argl, void* args)
+{
+	pi_mutex = MUTEX_INIT;
+	pi_locked = pi_done = 0;
+
+	Tid_t low = CreateThread(pi_low_task, 0, NULL);
+	while(! pi_locked)
+		sleep_msec(10);
+
+	/* The new threads start at the top priority */
+	Tid_t middle = CreateThread(pi_middle_task, 0, NULL);
+	Tid_t high = CreateThread(pi_high_task, argl, args);
+
+	ThreadJoin(high, NULL);
+	ThreadJoin(middle, NULL);
+	ThreadJoin(low, NULL);
+	return 0;
+}
+
+BARE_TEST(test_mutex_priority_inheritance,
+	"Test that the holder of a mutex inherits the priority of a waiter, so that\n"
+	"a CPU-bound thread of middle priority cannot delay the waiter for long.",
+	.timeout = 20)
+{
+	TimerDuration wait;
+	TimerDuration* wait_ptr = &wait;
+	boot_options opts = { .quantum = 1000, .boost_period = 10000000, .fixed_quantum = 1 };
+	boot_with_options(1, 0, pi_boot, sizeof(wait_ptr), &wait_ptr, &opts);
+
+	/* Without inheritance, the middle thread runs until it sinks below the holder */
+	ASSERT_MSG(wait < 150000, "the waiter waited %lu usec\n", (unsigned long) wait);
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1407,10 +2168,15 @@ TEST_SUITE(thread_tests,
 	&test_detach_after_join,
 	&test_create_join_thread,
 	&test_join_many_threads,
+	&test_thread_churn,
 	&test_exit_many_threads,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_create_thread_attr,
+	&test_thread_affinity,
+	&test_realtime_deadlines,
+	&test_mutex_priority_inheritance,
 	NULL
 };
 
@@ -1508,6 +2274,29 @@ BOOT_TEST(test_pipe_close_writer,
 	return 0;
 }
 
+static int pipe_blocked_reader(int argl, void* args)
+{
+	char buffer[12];
+	return Read(*(Fid_t*)args, buffer, 12);
+}
+
+BOOT_TEST(test_pipe_close_writer_wakes_reader,
+	"Check that a reader blocked on an empty pipe returns 0, when the writer end is closed"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	Tid_t t = CreateThread(pipe_blocked_reader, sizeof(Fid_t), &pipe.read);
+	sleep_msec(50);
+	Close(pipe.write);
+
+	int rc = -1;
+	ASSERT(ThreadJoin(t, &rc)==0);
+	ASSERT_MSG(rc==0, "Read returned %d\n", rc);
+	return 0;
+}
+
 
 /* Takes one integer argument, writes that many bytes to stdout.
  */
@@ -1628,6 +2417,48 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+/* Write numbered messages to a pipe of its own and read them back */
+static int pipe_echo_own(int argl, void* args)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	for(int i=0; i<10000; i++) {
+		int msg[4] = { argl, i, -i, argl };
+		int back[4];
+		ASSERT(Write(pipe.write, (char*)msg, sizeof(msg))==sizeof(msg));
+		ASSERT(Read(pipe.read, (char*)back, sizeof(back))==sizeof(back));
+		ASSERT(memcmp(msg, back, sizeof(msg))==0);
+	}
+
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_parallel_threads,
+	"Test that threads of a process can use their own pipes at the same time, while\n"
+	"another thread opens and closes streams in the same process."
+	)
+{
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(pipe_echo_own, i, NULL);
+
+	for(int i=0; i<1000; i++) {
+		Fid_t fid = OpenNull();
+		ASSERT(fid!=NOFILE);
+		ASSERT(Dup2(fid, MAX_FILEID-1)==0);
+		ASSERT(Close(MAX_FILEID-1)==0);
+		ASSERT(Close(fid)==0);
+	}
+
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1636,8 +2467,10 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
+	&test_pipe_close_writer_wakes_reader,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_parallel_threads,
 	NULL
 };
 
@@ -2184,6 +3017,44 @@ BOOT_TEST(test_shudown_write,
 }
 
 
+static int shutdown_blocked_reader(int argl, void* args)
+{
+	char buffer[12];
+	return Read(argl, buffer, 12);
+}
+
+BOOT_TEST(test_shutdown_unblocks_read,
+	"Test that ShutDown with SHUTDOWN_READ, from another thread, makes a Read\n"
+	"blocked on the socket return -1, and leaves the other direction working."
+	)
+{
+	Fid_t lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	if(lsock!=0) { Dup2(lsock,0); Close(lsock); }
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* Let the reader block on the empty socket, then shut it down under it */
+	Tid_t t = CreateThread(shutdown_blocked_reader, cli, NULL);
+	ASSERT(t != NOTHREAD);
+	sleep_msec(50);
+	ASSERT(ShutDown(cli, SHUTDOWN_READ)==0);
+
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == -1);
+
+	for(uint i=0; i< 100; i++)
+		check_transfer(cli, srv);
+
+	return 0;
+}
+
+
 
 
 TEST_SUITE(socket_tests,
@@ -2220,6 +3091,7 @@ TEST_SUITE(socket_tests,
 
 	&test_shudown_read,
 	&test_shudown_write,
+	&test_shutdown_unblocks_read,
 
 	NULL
 };